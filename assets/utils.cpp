@@ -1,5 +1,6 @@
 #include "utils.hpp"
 #include "../core/shader.hpp"
+#include "../core/texturecache.hpp"
 #include <iostream>
 #include <vector>
 
@@ -20,9 +21,7 @@ void ReferenceMarker::draw(glm::mat4 projection, glm::mat4 view, glm::mat4 model
     _shader->use();    
 
     // setup camera geometry parameters
-    _shader->setMat4("projection", projection);
-    _shader->setMat4("view", view);
-    _shader->setMat4("model", model, GL_TRUE);
+    _shader->setMat4("mvp", projection * view * glm::transpose(model));
     
     // draw mesh vertex array
     VAO()->draw(GL_LINES);
@@ -55,21 +54,21 @@ TextureLoader::TextureLoader()
             m = new Material(glm::vec3(1.0), glm::vec3(1.0), glm::vec3(1.0), 0.1);
             
             //Load diffuse texture
-            Texture* texture = Texture::fromFile((texname+"_base.png"), "textures", Texture::Diffuse);
+            Texture* texture = TextureCache::acquire((texname+"_base.png"), "textures", Texture::Diffuse);
             if(texture)
                 texs.push_back(texture);
             else
                 DEBUG(Debug::Error, "Cannot load texture %s\n", (texname+"_base.png").c_str());
             
             //Load Normals texture
-            texture = Texture::fromFile((texname+"_normal.png"), "textures", Texture::Normal);
+            texture = TextureCache::acquire((texname+"_normal.png"), "textures", Texture::Normal);
             if(texture)
                 texs.push_back(texture);
             else
                 DEBUG(Debug::Error, "Cannot load texture %s\n", (texname+"_normal.png").c_str());
             
             //Load Normals texture
-            texture = Texture::fromFile((texname+"_height.png"), "textures", Texture::Height);
+            texture = TextureCache::acquire((texname+"_height.png"), "textures", Texture::Height);
             if (texture)
                 texs.push_back(texture);
             else
@@ -85,6 +84,13 @@ TextureLoader::TextureLoader()
     
 }
 
+std::vector<Material*> TextureLoader::materials() {
+    std::vector<Material*> materials;
+    for (auto m: MATERIALS)
+        materials.push_back(m.second);
+    return materials;
+}
+
 void TextureLoader::loadTextures(Node *root) {
     
     //Get root node
@@ -29,6 +29,8 @@ class TextureLoader {
     public:
         TextureLoader();
         void loadTextures(Node *node);
+        
+        static std::vector<Material*> materials();
 };
 
 
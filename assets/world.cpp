@@ -75,18 +75,18 @@ Scene* DinoWorld::buildScene(){
     // Arm animation
     Animation* opening_hand = new Animation("FingerClose", 80, 20);
     Channel* c = new Channel(main_scene->rootNode()->find("FingerL_low_001"));
-    c->addKey(0, new RotationKey(glm::quat(glm::vec3(0, glm::radians(0.), 0))));
-    c->addKey(40, new RotationKey(glm::quat(glm::vec3(0, glm::radians(60.), 0))));
-    c->addKey(80, new RotationKey(glm::quat(glm::vec3(0, glm::radians(0.), 0))));
-    c->addKey(0, new PositionKey(glm::vec3(-0.90, 0.01, 0)));
-    c->addKey(80, new PositionKey(glm::vec3(-0.90, 0.01, 0)));
+    c->addRotationKey(0, glm::quat(glm::vec3(0, glm::radians(0.), 0)));
+    c->addRotationKey(40, glm::quat(glm::vec3(0, glm::radians(60.), 0)));
+    c->addRotationKey(80, glm::quat(glm::vec3(0, glm::radians(0.), 0)));
+    c->addPositionKey(0, glm::vec3(-0.90, 0.01, 0));
+    c->addPositionKey(80, glm::vec3(-0.90, 0.01, 0));
     opening_hand->addChannel(c);
     c = new Channel(main_scene->rootNode()->find("FingerR_low_001"));
-    c->addKey(0, new RotationKey(glm::quat(glm::vec3(0, glm::radians(0.), 0))));
-    c->addKey(40, new RotationKey(glm::quat(glm::vec3(0, glm::radians(-60.), 0))));
-    c->addKey(80, new RotationKey(glm::quat(glm::vec3(0, glm::radians(0.), 0))));
-    c->addKey(0, new PositionKey(glm::vec3(-0.90, -0.01, 0)));
-    c->addKey(80, new PositionKey(glm::vec3(-0.90, -0.01, 0)));
+    c->addRotationKey(0, glm::quat(glm::vec3(0, glm::radians(0.), 0)));
+    c->addRotationKey(40, glm::quat(glm::vec3(0, glm::radians(-60.), 0)));
+    c->addRotationKey(80, glm::quat(glm::vec3(0, glm::radians(0.), 0)));
+    c->addPositionKey(0, glm::vec3(-0.90, -0.01, 0));
+    c->addPositionKey(80, glm::vec3(-0.90, -0.01, 0));
     opening_hand->addChannel(c);
     
     main_scene->addAnimation(opening_hand);  
@@ -94,12 +94,12 @@ Scene* DinoWorld::buildScene(){
     // Ptero animation  
     Animation* ptero_flying = new Animation("PteroAnim", 400, 20);
     c = new Channel(ptero_scene->findNode("Plane"));
-    c->addKey(0, new PositionKey(glm::vec3(-20, -20, 150.)));
-    c->addKey(380, new PositionKey(glm::vec3(-20, -20, -150.)));
-    c->addKey(390, new PositionKey(glm::vec3(150, -20, -150.)));
-    c->addKey(400, new PositionKey(glm::vec3(150, -20, 150.)));
-    c->addKey(0, new ScaleKey(glm::vec3(0.2)));
-    c->addKey(400, new ScaleKey(glm::vec3(0.2)));
+    c->addPositionKey(0, glm::vec3(-20, -20, 150.));
+    c->addPositionKey(380, glm::vec3(-20, -20, -150.));
+    c->addPositionKey(390, glm::vec3(150, -20, -150.));
+    c->addPositionKey(400, glm::vec3(150, -20, 150.));
+    c->addScaleKey(0, glm::vec3(0.2));
+    c->addScaleKey(400, glm::vec3(0.2));
     ptero_flying->addChannel(c);
     
     main_scene->addAnimation(ptero_flying); 
@@ -1,119 +1,780 @@
 #include "animations.hpp"
 
 #include <math.h>
+#include <algorithm>
+#include <iomanip>
 #include "glm/glm.hpp"
 #include "glm/gtc/matrix_transform.hpp"
 
 #include "models.hpp"
 #include "scene.hpp"
 #include "common.hpp"
+#include "jobs.hpp"
+#include "profiler.hpp"
+#include "camera.hpp"
 
 
-void Channel::applyBones(float AnimationTime, glm::mat4& currentTransformation, const glm::mat4& GlobalInverseTransform)
-{                
-    float DeltaTime, Factor;
-    
-    std::pair<std::pair<float, PositionKey*>, std::pair<float, PositionKey*>> poskey = getPosKeys(AnimationTime);
-    
-    glm::vec3 pos(0.f);
-    if (poskey.first.second != nullptr && poskey.second.second != nullptr){
-        DeltaTime = poskey.second.first - poskey.first.first;
-        Factor = (AnimationTime - poskey.first.first) / DeltaTime;
-        pos = glm::vec3(poskey.first.second->position());
-        pos += Factor * (poskey.second.second->position() - poskey.first.second->position());
+bool AnimationLOD::ENABLED = true;
+float AnimationLOD::FULL_RATE_SIZE = 0.05f;
+int AnimationLOD::MAX_INTERVAL = 8;
+unsigned AnimationLOD::NEXT_PHASE = 0;
+
+AnimationLOD::AnimationLOD(Node* anchor):
+    _anchor(nullptr),
+    _spheres(),
+    _phase(NEXT_PHASE++),
+    _interval(1),
+    _visible(true)
+{
+    setAnchor(anchor);
+}
+
+void AnimationLOD::setAnchor(Node* anchor){
+    _anchor = anchor;
+    _spheres.clear();
+    if (!anchor)
+        return;
+    _collect(anchor, _spheres);
+    // Nothing known of a bare node, taken as a unit sphere
+    if (_spheres.empty())
+        _spheres.push_back(std::make_pair(anchor, 1.f));
+}
+
+void AnimationLOD::_collect(Node* n, std::vector<std::pair<Node*, float>>& spheres){
+    float r = 0.f;
+    for (std::pair<std::string, Drawable*> child: n->children()){
+        if (dynamic_cast<Mesh*>(child.second)){
+            VertexArray* va = ((Mesh*)child.second)->VAO();
+            if (va)
+                r = std::max(r, va->radius());
+        } else if (dynamic_cast<Node*>(child.second))
+            _collect((Node*)child.second, spheres);
     }
-    
-    std::pair<std::pair<float, ScaleKey*>, std::pair<float, ScaleKey*>> scakey = getScaKeys(AnimationTime);
-    
-    glm::vec3 sca(1.f);
-    if (scakey.first.second != nullptr && scakey.second.second != nullptr){
-        DeltaTime = scakey.second.first - scakey.first.first;
-        Factor = (AnimationTime - scakey.first.first) / DeltaTime;
-        sca = glm::vec3(scakey.first.second->dimenssion());
-        sca += Factor * (scakey.second.second->dimenssion() - scakey.first.second->dimenssion());
+    if (r > 0.f)
+        spheres.push_back(std::make_pair(n, r));
+}
+
+bool AnimationLOD::due(const glm::mat4& viewProjection, const glm::vec3& eye, unsigned frame){
+    if (!_anchor){
+        _interval = 1;
+        _visible = true;
+        return true;
     }
     
-    std::pair<std::pair<float, RotationKey*>, std::pair<float, RotationKey*>> rotkey = getRotKeys(AnimationTime);
-    glm::quat rot(0.f, 0.f, 0.f, 0.f);
-    if (rotkey.first.second != nullptr && rotkey.second.second != nullptr){
-        DeltaTime = rotkey.second.first - rotkey.first.first;
-        Factor = (AnimationTime - rotkey.first.first) / DeltaTime;
-        rot = glm::mix(rotkey.first.second->rotation(), rotkey.second.second->rotation(), Factor);
+    // Node::draw composes the stored matrices from the root down and transposes the product, a parent's
+    // rotation does not carry its children along as globalTransformation assumes: each mesh is placed on its own
+    _visible = false;
+    float size = 0.f;
+    for (const std::pair<Node*, float>& s: _spheres){
+        glm::mat4 world = glm::transpose(s.first->inverseTransformation());
+        glm::vec3 center(world[3]);
+        float r = s.second * std::max(glm::length(glm::vec3(world[0])), std::max(glm::length(glm::vec3(world[1])), glm::length(glm::vec3(world[2]))));
+        
+        // Sphere against the six planes of the frustum, rows of viewProjection added to or taken from the last one
+        bool inside = true;
+        for (int p = 0; p < 6 && inside; p++){
+            int row = p / 2;
+            float sign = p % 2 ? -1.f : 1.f;
+            glm::vec4 plane;
+            for (int c = 0; c < 4; c++)
+                plane[c] = viewProjection[c][3] + sign * viewProjection[c][row];
+            inside = glm::dot(glm::vec3(plane), center) + plane.w >= -r * glm::length(glm::vec3(plane));
+        }
+        if (!inside)
+            continue;
+        _visible = true;
+        float distance = glm::length(center - eye);
+        size = std::max(size, distance > r ? r / distance : 1.f);
+    }
+    if (!_visible){
+        // Still sampled now and then: the anchor may be what the animation moves, and only its new pose brings it back into view
+        _interval = MAX_INTERVAL;
+        return (frame + _phase) % _interval == 0;
     }
     
-    glm::mat4 trans(_node->inverseTransformation());
-        
+    _interval = size >= FULL_RATE_SIZE ? 1 : std::min(MAX_INTERVAL, (int)(FULL_RATE_SIZE / size));
+    return (frame + _phase) % _interval == 0;
+}
+
+glm::mat4 Channel::transformation(float AnimationTime, const glm::mat4& pose, const glm::mat4& inverse) const {
+    glm::vec3 pos = position(AnimationTime);
+    glm::vec3 sca = scale(AnimationTime);
+    glm::quat rot = rotation(AnimationTime);
+    
     glm::mat4 translate(1.f);
     translate[0][3] = pos.x;
     translate[1][3] = pos.y;
     translate[2][3] = pos.z;
         
-    _node->setTransformation(glm::inverse(trans) * (glm::toMat4(rot) * glm::scale(translate, sca)) * trans);
+    return inverse * (glm::toMat4(rot) * glm::scale(translate, sca)) * pose;
+}
+
+static inline glm::vec3 interpolate(const glm::vec3& a, const glm::vec3& b, float factor){
+    return a + factor * (b - a);
+}
+
+static inline glm::quat interpolate(const glm::quat& a, const glm::quat& b, float factor){
+    // q and -q are the same rotation but glm::mix does not pick the short way between them,
+    // and quantized keys each got the sign of their own largest component
+    return glm::mix(a, glm::dot(a, b) < 0.f ? -b : b, factor);
+}
+
+glm::vec3 Channel::position(float AnimationTime) const {
+    int i = _find(_positions.times, _positions.count, _positions.cursor, AnimationTime);
+    if (i < 0)
+        return glm::vec3(0.f);
+    float factor = (AnimationTime - _positions.times[i]) / (_positions.times[i + 1] - _positions.times[i]);
+    glm::vec3 from = _value(_positions, i);
+    return from + factor * (_value(_positions, i + 1) - from);
+}
+
+glm::quat Channel::rotation(float AnimationTime) const {
+    int i = _find(_rotations.times, _rotations.count, _rotations.cursor, AnimationTime);
+    if (i < 0)
+        return glm::quat(0.f, 0.f, 0.f, 0.f);
+    float factor = (AnimationTime - _rotations.times[i]) / (_rotations.times[i + 1] - _rotations.times[i]);
+    return interpolate(_value(_rotations, i), _value(_rotations, i + 1), factor);
+}
+
+glm::vec3 Channel::scale(float AnimationTime) const {
+    int i = _find(_scales.times, _scales.count, _scales.cursor, AnimationTime);
+    if (i < 0)
+        return glm::vec3(1.f);
+    float factor = (AnimationTime - _scales.times[i]) / (_scales.times[i + 1] - _scales.times[i]);
+    glm::vec3 from = _value(_scales, i);
+    return from + factor * (_value(_scales, i + 1) - from);
+}
+
+void Channel::addPositionKey(float t, glm::vec3 position){
+    _insert(_positions, t, position);
+}
+void Channel::addRotationKey(float t, glm::quat rotation){
+    _insert(_rotations, t, glm::normalize(rotation));
+}
+void Channel::addScaleKey(float t, glm::vec3 scale){
+    _insert(_scales, t, scale);
+}
+
+template <class T>
+void Channel::_insert(Track<T>& track, float t, const T& value){
+    // Keys already packed come first, see _pack
+    for (size_t k = 0; k < track.count; k++)
+        if (track.times[k] == t)
+            return;
+    auto it = std::lower_bound(track.pending.begin(), track.pending.end(), t, [](const std::pair<float, T>& key, float t){ return key.first < t; });
+    if (it == track.pending.end() || it->first != t)
+        track.pending.insert(it, std::make_pair(t, value));
+}
+
+int Channel::_find(const float* times, size_t count, size_t& cursor, float AnimationTime){
+    if (count < 2 || AnimationTime >= times[count - 1])
+        return -1;
+    
+    size_t i = cursor;
+    if (i + 1 < count && times[i] <= AnimationTime && AnimationTime < times[i + 1])
+        return i;
+    if (i + 2 < count && times[i + 1] <= AnimationTime && AnimationTime < times[i + 2])
+        return cursor = i + 1;
+    
+    // Looped or jumped: the first key after AnimationTime, before it the first one
+    const float* next = std::upper_bound(times, times + count, AnimationTime);
+    cursor = next == times ? 0 : next - times - 1;
+    return cursor;
+}
 
-    for (Bone*b: _bones){
-        b->node()->setTransformation(currentTransformation);
+// Smallest three: the largest component is left out, rebuilt from the unit length,
+// its index takes 2 bits and the three others 15 bits each in [-1/sqrt(2), 1/sqrt(2)]
+#define QUAT_RANGE 0.70710678f
+#define QUAT_STEPS 32767.f
+
+glm::vec3 Channel::_value(const Track<glm::vec3>& track, size_t k){
+    if (!track.compressed)
+        return track.values[k];
+    const uint16_t* q = track.quantized + 3 * k;
+    return track.origin + track.extent * glm::vec3(q[0], q[1], q[2]) / 65535.f;
+}
+
+glm::quat Channel::_value(const Track<glm::quat>& track, size_t k){
+    if (!track.compressed)
+        return track.values[k];
+    const uint16_t* q = track.quantized + 3 * k;
+    uint64_t bits = (uint64_t)q[0] | ((uint64_t)q[1] << 16) | ((uint64_t)q[2] << 32);
+    int largest = bits >> 45;
+    float c[4], sum = 0.f;
+    for (int i = 0, j = 0; i < 4; i++){
+        if (i == largest)
+            continue;
+        c[i] = ((bits >> (15 * (2 - j))) & 0x7FFF) / QUAT_STEPS * 2.f * QUAT_RANGE - QUAT_RANGE;
+        sum += c[i] * c[i];
+        j++;
     }
+    c[largest] = sqrtf(std::max(0.f, 1.f - sum));
+    return glm::quat(c[0], c[1], c[2], c[3]);
 }
-std::pair<std::pair<float, PositionKey*>, std::pair<float, PositionKey*>> Channel::getPosKeys(float AnimationTime) const {
-    if (!_positions_keys.empty()){
-        auto next = _positions_keys.begin();
-        auto prev = next++;
-        for (; next != _positions_keys.end();){
-            if (next->first > AnimationTime)
-                return std::make_pair(*prev, *next);
-            else
-                prev = next++;
-        }
+
+void Channel::_quantize(Track<glm::vec3>& track, const std::vector<std::pair<float, glm::vec3>>& keys, uint16_t* out){
+    glm::vec3 lo(0.f), hi(0.f);
+    if (!keys.empty())
+        lo = hi = keys[0].second;
+    for (const std::pair<float, glm::vec3>& k: keys){
+        lo = glm::min(lo, k.second);
+        hi = glm::max(hi, k.second);
     }
-    return std::make_pair(std::make_pair(0, nullptr), std::make_pair(0, nullptr));
-}
-std::pair<std::pair<float, RotationKey*>, std::pair<float, RotationKey*>> Channel::getRotKeys(float AnimationTime) const {
-    if (!_rotations_keys.empty()){
-        auto next = _rotations_keys.begin();
-        auto prev = next++;
-        for (; next != _rotations_keys.end();){
-            if (next->first > AnimationTime)
-                return std::make_pair(*prev, *next);
-            else
-                prev = next++;
+    track.origin = lo;
+    track.extent = hi - lo;
+    for (const std::pair<float, glm::vec3>& k: keys){
+        for (int c = 0; c < 3; c++)
+            *out++ = track.extent[c] > 0.f ? (uint16_t)roundf((k.second[c] - lo[c]) / track.extent[c] * 65535.f) : 0;
+    }
+}
+
+void Channel::_quantize(Track<glm::quat>& track, const std::vector<std::pair<float, glm::quat>>& keys, uint16_t* out){
+    for (const std::pair<float, glm::quat>& k: keys){
+        float c[4] = {k.second.w, k.second.x, k.second.y, k.second.z};
+        int largest = 0;
+        for (int i = 1; i < 4; i++)
+            if (fabsf(c[i]) > fabsf(c[largest]))
+                largest = i;
+        // q and -q are the same rotation, keep the left out component positive
+        float sign = c[largest] < 0.f ? -1.f : 1.f;
+        
+        uint64_t bits = (uint64_t)largest << 45;
+        for (int i = 0, j = 0; i < 4; i++){
+            if (i == largest)
+                continue;
+            float v = glm::clamp(c[i] * sign, -QUAT_RANGE, QUAT_RANGE);
+            bits |= (uint64_t)roundf((v + QUAT_RANGE) / (2.f * QUAT_RANGE) * QUAT_STEPS) << (15 * (2 - j));
+            j++;
         }
+        *out++ = bits & 0xFFFF;
+        *out++ = (bits >> 16) & 0xFFFF;
+        *out++ = (bits >> 32) & 0xFFFF;
     }
-    return std::make_pair(std::make_pair(0, nullptr), std::make_pair(0, nullptr));
-}
-std::pair<std::pair<float, ScaleKey*>, std::pair<float, ScaleKey*>> Channel::getScaKeys(float AnimationTime) const {
-    if (!_scales_keys.empty()){
-        auto next = _scales_keys.begin();
-        auto prev = next++;
-        for (; next != _scales_keys.end();){
-            if (next->first > AnimationTime)
-                return std::make_pair(*prev, *next);
-            else
-                prev = next++;
+}
+
+template <class T>
+std::vector<std::pair<float, T>> Channel::_keys(const Track<T>& track){
+    std::vector<std::pair<float, T>> keys;
+    for (size_t k = 0; k < track.count; k++)
+        keys.push_back(std::make_pair(track.times[k], _value(track, k)));
+    for (const std::pair<float, T>& key: track.pending){
+        auto it = std::lower_bound(keys.begin(), keys.end(), key.first, [](const std::pair<float, T>& k, float t){ return k.first < t; });
+        keys.insert(it, key);
+    }
+    return keys;
+}
+
+template <class T>
+T Channel::_sample(const Track<T>& track, float AnimationTime){
+    if (!track.count)
+        return T();
+    if (AnimationTime <= track.times[0])
+        return _value(track, 0);
+    if (AnimationTime >= track.times[track.count - 1])
+        return _value(track, track.count - 1);
+    size_t cursor = 0;
+    int i = _find(track.times, track.count, cursor, AnimationTime);
+    float factor = (AnimationTime - track.times[i]) / (track.times[i + 1] - track.times[i]);
+    return interpolate(_value(track, i), _value(track, i + 1), factor);
+}
+
+template <class T, class E>
+std::vector<std::pair<float, T>> Channel::_reduce(const std::vector<std::pair<float, T>>& keys, float tolerance, E error){
+    if (keys.size() < 3)
+        return keys;
+    
+    // Stretch the segment from the last kept key as long as every key it skips stays within tolerance
+    std::vector<std::pair<float, T>> kept(1, keys[0]);
+    size_t anchor = 0;
+    for (size_t end = 2; end < keys.size(); end++){
+        const std::pair<float, T>& a = keys[anchor];
+        const std::pair<float, T>& b = keys[end];
+        for (size_t k = anchor + 1; k < end; k++){
+            float factor = (keys[k].first - a.first) / (b.first - a.first);
+            if (error(interpolate(a.second, b.second, factor), keys[k].second) > tolerance){
+                anchor = end - 1;
+                kept.push_back(keys[anchor]);
+                break;
+            }
         }
     }
-    return std::make_pair(std::make_pair(0, nullptr), std::make_pair(0, nullptr));
+    kept.push_back(keys.back());
+    return kept;
 }
 
-RotationKey::RotationKey(glm::quat value): _value(value){
-    _value = normalize(value);
+template <class T>
+size_t Channel::_bytes(const Track<T>& track){
+    size_t count = track.count + track.pending.size();
+    size_t values = track.compressed ? count * 3 * sizeof(uint16_t) : count * sizeof(T);
+    // Next track starts 4 bytes aligned
+    return count * sizeof(float) + (values + 3) / 4 * 4;
 }
 
-void Animation::applyBones(float AnimationTime, Scene* s)
-{    
-    glm::mat4 ParentTransform(1.f);
-    _recusive_bones(s->rootNode(), s, glm::inverse(s->rootNode()->transformation()), ParentTransform, AnimationTime);
+template <class T>
+unsigned char* Channel::_pack(Track<T>& track, unsigned char* out){
+    std::vector<std::pair<float, T>> keys = _keys(track);
+    std::vector<std::pair<float, T>>().swap(track.pending);
+    
+    float* times = (float*)out;
+    for (size_t k = 0; k < keys.size(); k++)
+        times[k] = keys[k].first;
+    out += keys.size() * sizeof(float);
+    
+    if (track.compressed){
+        uint16_t* quantized = (uint16_t*)out;
+        _quantize(track, keys, quantized);
+        track.quantized = quantized;
+        track.values = nullptr;
+        out += (keys.size() * 3 * sizeof(uint16_t) + 3) / 4 * 4;
+    } else {
+        T* values = (T*)out;
+        for (size_t k = 0; k < keys.size(); k++)
+            values[k] = keys[k].second;
+        track.values = values;
+        track.quantized = nullptr;
+        out += keys.size() * sizeof(T);
+    }
+    track.times = times;
+    track.count = keys.size();
+    track.cursor = 0;
+    return out;
+}
+
+std::vector<Animation*> Animation::INSTANCES;
+float Animation::COMPRESSION_TOLERANCE = 0.f;
+
+Animation::Animation(std::string name, double duration, double tick_per_sec): 
+    _name(name),
+    _tick_per_sec(tick_per_sec),
+    _duration(duration),
+    _block(),
+    _packed(true),
+    _bound(false),
+    _channels(),
+    _bind_pose(),
+    _bind_inverse(),
+    _pose()
+{
+    INSTANCES.push_back(this);
 }
 
-void Animation::_recusive_bones(Node* n, Scene* s, const glm::mat4& globalInverseTransform, const glm::mat4& ParentTransform, float AnimationTime){
-    glm::mat4 localTransform = ParentTransform;
-    if (_channel.find(n) != _channel.end()){
-        Channel* c = _channel.find(n)->second;
-        c->applyBones(AnimationTime, localTransform, globalInverseTransform);
+Animation::~Animation(){
+    INSTANCES.erase(std::remove(INSTANCES.begin(), INSTANCES.end(), this), INSTANCES.end());
+}
+
+void Animation::_pack(){
+    size_t bytes = 0;
+    for (auto c: _channel)
+        bytes += Channel::_bytes(c.second->_positions) + Channel::_bytes(c.second->_rotations) + Channel::_bytes(c.second->_scales);
     
+    // Channels still read the old block while the new one is written
+    std::vector<unsigned char> block(bytes);
+    unsigned char* out = block.data();
+    for (auto c: _channel){
+        out = Channel::_pack(c.second->_positions, out);
+        out = Channel::_pack(c.second->_rotations, out);
+        out = Channel::_pack(c.second->_scales, out);
     }
-        
+    _block.swap(block);
+    _packed = true;
+}
+
+void Animation::bind(){
+    if (!_packed)
+        _pack();
+    
+    std::vector<std::pair<int, Channel*>> ordered;
+    for (auto c: _channel){
+        int depth = 0;
+        for (Node* p = c.first->parent(); p; p = p->parent())
+            depth++;
+        ordered.push_back(std::make_pair(depth, c.second));
+    }
+    std::stable_sort(ordered.begin(), ordered.end(), [](const std::pair<int, Channel*>& a, const std::pair<int, Channel*>& b){ return a.first < b.first; });
+    
+    _channels.clear();
+    _bind_pose.clear();
+    _bind_inverse.clear();
+    for (auto& o: ordered){
+        _channels.push_back(o.second);
+        _bind_pose.push_back(o.second->node()->inverseTransformation());
+        _bind_inverse.push_back(glm::inverse(_bind_pose.back()));
+    }
+    _pose.resize(_channels.size());
+    _lod.setAnchor(_channels.empty() ? nullptr : _channels[0]->node());
+    _bound = true;
+}
+
+int Animation::_animatedBelow(Node* n) const {
+    int below = 0;
     for (std::pair<std::string, Drawable*> child: n->children())
         if (dynamic_cast<Node*>(child.second))
-            _recusive_bones((Node*)child.second, s, localTransform, globalInverseTransform,AnimationTime);
+            below = std::max(below, _animatedBelow((Node*)child.second));
+    return below + (_channel.count(n) ? 1 : 0);
+}
+
+int Animation::_chainLength(Node* n) const {
+    int above = 0;
+    for (Node* p = n->parent(); p; p = p->parent())
+        above += _channel.count(p) ? 1 : 0;
+    return std::max(1, above + _animatedBelow(n));
 }
 
+float Animation::_reach(Node* n){
+    float reach = 0.f;
+    for (std::pair<std::string, Drawable*> child: n->children()){
+        if (!dynamic_cast<Node*>(child.second))
+            continue;
+        // Stored transposed, the translation is the last row
+        glm::mat4 t = ((Node*)child.second)->transformation();
+        reach = std::max(reach, glm::length(glm::vec3(t[0][3], t[1][3], t[2][3])) + _reach((Node*)child.second));
+    }
+    return reach;
+}
+
+void Animation::compress(float tolerance){
+    if (!_packed)
+        _pack();
+    
+    struct Original {
+        Channel* channel;
+        std::vector<std::pair<float, glm::vec3>> positions, scales;
+        std::vector<std::pair<float, glm::quat>> rotations;
+        float reach;
+    };
+    std::vector<Original> originals;
+    size_t keys_before = keyCount(), bytes_before = _block.size();
+    
+    for (auto c: _channel){
+        Channel* ch = c.second;
+        Node* n = ch->node();
+        glm::mat4 t = n->transformation();
+        
+        // Rotating or scaling a node moves its farthest descendant the most; a leaf moves its own mesh
+        Original o;
+        o.channel = ch;
+        o.reach = std::max(std::max(_reach(n), glm::length(glm::vec3(t[0][3], t[1][3], t[2][3]))), 1e-3f);
+        o.positions = Channel::_keys(ch->_positions);
+        o.rotations = Channel::_keys(ch->_rotations);
+        o.scales = Channel::_keys(ch->_scales);
+        originals.push_back(o);
+        
+        float share = tolerance / _chainLength(n);
+        float reach = o.reach;
+        ch->_positions.pending = Channel::_reduce(o.positions, share, [](const glm::vec3& a, const glm::vec3& b){ return glm::length(a - b); });
+        ch->_rotations.pending = Channel::_reduce(o.rotations, share, [reach](const glm::quat& a, const glm::quat& b){
+            return 2.f * acosf(std::min(1.f, fabsf(glm::dot(a, b)))) * reach;
+        });
+        ch->_scales.pending = Channel::_reduce(o.scales, share, [reach](const glm::vec3& a, const glm::vec3& b){ return glm::length(a - b) * reach; });
+        ch->_positions.count = ch->_rotations.count = ch->_scales.count = 0;
+        ch->_positions.compressed = ch->_rotations.compressed = ch->_scales.compressed = true;
+    }
+    _pack();
+    
+    // Measured where the original keys were and halfway between them, quantization included:
+    // a segment interpolated the long way round only shows between its keys
+    float position_error = 0.f, rotation_error = 0.f, scale_error = 0.f;
+    auto angle = [](glm::quat q, const glm::quat& expected){
+        // A quantized key may have the opposite sign of the original one, it is the same pose
+        if (glm::dot(q, expected) < 0.f)
+            q = -q;
+        return 2.f * acosf(std::min(1.f, glm::dot(q, expected)));
+    };
+    for (const Original& o: originals){
+        for (size_t k = 0; k < o.positions.size(); k++){
+            position_error = std::max(position_error, glm::length(Channel::_sample(o.channel->_positions, o.positions[k].first) - o.positions[k].second));
+            if (k + 1 == o.positions.size())
+                continue;
+            float t = 0.5f * (o.positions[k].first + o.positions[k + 1].first);
+            glm::vec3 expected = interpolate(o.positions[k].second, o.positions[k + 1].second, 0.5f);
+            position_error = std::max(position_error, glm::length(Channel::_sample(o.channel->_positions, t) - expected));
+        }
+        for (size_t k = 0; k < o.rotations.size(); k++){
+            rotation_error = std::max(rotation_error, angle(Channel::_sample(o.channel->_rotations, o.rotations[k].first), o.rotations[k].second));
+            if (k + 1 == o.rotations.size())
+                continue;
+            float t = 0.5f * (o.rotations[k].first + o.rotations[k + 1].first);
+            glm::quat expected = interpolate(o.rotations[k].second, o.rotations[k + 1].second, 0.5f);
+            rotation_error = std::max(rotation_error, angle(Channel::_sample(o.channel->_rotations, t), expected));
+        }
+        for (size_t k = 0; k < o.scales.size(); k++){
+            scale_error = std::max(scale_error, glm::length(Channel::_sample(o.channel->_scales, o.scales[k].first) - o.scales[k].second));
+            if (k + 1 == o.scales.size())
+                continue;
+            float t = 0.5f * (o.scales[k].first + o.scales[k + 1].first);
+            glm::vec3 expected = interpolate(o.scales[k].second, o.scales[k + 1].second, 0.5f);
+            scale_error = std::max(scale_error, glm::length(Channel::_sample(o.channel->_scales, t) - expected));
+        }
+    }
+    
+    std::cout << "Animation " << _name << ": " << keys_before << " -> " << keyCount() << " keys, " << bytes_before << " -> " << _block.size()
+              << " bytes (" << std::fixed << std::setprecision(1) << (_block.size() ? (double)bytes_before / _block.size() : 0.) << ":1), max error "
+              << std::setprecision(4) << position_error << " translation, " << glm::degrees(rotation_error) << " deg, " << scale_error << " scale" << std::endl;
+}
+
+size_t Animation::keyCount() const {
+    size_t keys = 0;
+    for (auto c: _channel)
+        keys += c.second->keyCount();
+    return keys;
+}
+
+void Animation::memoryReport(){
+    // Each key used to be a std::map node holding its time and a pointer, plus a heap object
+    // with a vtable pointer, each allocation with its 16 bytes malloc header
+    const size_t node = 32 + sizeof(std::pair<float, void*>) + 16;
+    const size_t vec3_key = node + sizeof(void*) + sizeof(glm::vec3) + 16;
+    const size_t quat_key = node + sizeof(void*) + sizeof(glm::quat) + 16;
+    
+    size_t total_before = 0, total_after = 0, total_keys = 0;
+    std::cout << std::endl << "Animation keys (keys, bytes before, bytes after, bytes per key before -> after):" << std::endl;
+    for (Animation* a: INSTANCES){
+        if (!a->_packed)
+            a->_pack();
+        
+        size_t before = 0;
+        for (auto c: a->_channel)
+            before += (c.second->_positions.count + c.second->_scales.count) * vec3_key + c.second->_rotations.count * quat_key;
+        size_t after = a->_block.size();
+        size_t keys = a->keyCount();
+        
+        std::cout << std::setw(28) << a->name() << std::setw(8) << keys << std::setw(10) << before << std::setw(10) << after;
+        if (keys)
+            std::cout << std::setw(10) << std::fixed << std::setprecision(1) << (double)before / keys << " -> " << (double)after / keys;
+        std::cout << std::endl;
+        
+        total_before += before;
+        total_after += after;
+        total_keys += keys;
+    }
+    std::cout << "Total: " << total_keys << " keys, " << total_before / 1024 << " KiB -> " << total_after / 1024 << " KiB" << std::endl;
+}
+
+void Animation::applyBones(float AnimationTime)
+{    
+    if (!_bound)
+        bind();
+    sample(AnimationTime, 0, _channels.size());
+    writeBack();
+    // Bones read their node when the mesh is drawn, see Bone::transformation
+}
+
+void Animation::sample(float AnimationTime, size_t begin, size_t end){
+    for (size_t k = begin; k < end; k++)
+        _pose[k] = _channels[k]->transformation(AnimationTime, _bind_pose[k], _bind_inverse[k]);
+}
+
+void Animation::writeBack(){
+    for (size_t k = 0; k < _channels.size(); k++)
+        _channels[k]->node()->setTransformation(_pose[k]);
+}
+
+size_t Animation::GRAIN = 16;
+unsigned Animation::FRAME = 0;
+
+void Animation::play(const std::vector<Animation*>& playing, const std::vector<AnimationInstance*>& playing_instances, float timeInSeconds,
+                     const Camera* camera){
+    std::vector<Animation*> animations;
+    std::vector<AnimationInstance*> instances;
+    {
+        PROFILE_SCOPE("AnimationLOD::due");
+        unsigned frame = FRAME++;
+        glm::mat4 viewProjection = camera ? camera->projectionMatrix() * camera->viewMatrix() : glm::mat4(1.f);
+        glm::vec3 eye = camera ? glm::vec3(glm::inverse(camera->viewMatrix())[3]) : glm::vec3(0.f);
+        bool lod = camera && AnimationLOD::ENABLED;
+        
+        for (Animation* a: playing){
+            if (!a->_bound)
+                a->bind();
+            if (!lod || a->_lod.due(viewProjection, eye, frame))
+                animations.push_back(a);
+        }
+        for (AnimationInstance* i: playing_instances)
+            if (!lod || i->lod().due(viewProjection, eye, frame))
+                instances.push_back(i);
+    }
+    
+    // Channels of all animations one after the other, then one item per instance
+    std::vector<size_t> first(1, 0);
+    std::vector<float> times;
+    for (Animation* a: animations){
+        first.push_back(first.back() + a->channelCount());
+        times.push_back(fmod(a->timeInTick(timeInSeconds), a->duration()));
+    }
+    size_t channels = first.back();
+    
+    {
+        PROFILE_SCOPE("Animation::sample");
+        JobSystem::parallelFor(channels + instances.size(), GRAIN, [&](size_t begin, size_t end){
+            size_t a = std::upper_bound(first.begin(), first.end(), begin) - first.begin() - 1;
+            for (size_t k = begin; k < std::min(end, channels); a++){
+                size_t last = std::min(end, first[a + 1]);
+                animations[a]->sample(times[a], k - first[a], last - first[a]);
+                k = last;
+            }
+            for (size_t k = std::max(begin, channels); k < end; k++)
+                instances[k - channels]->sample(timeInSeconds);
+        });
+    }
+    
+    PROFILE_SCOPE("Animation::writeBack");
+    for (Animation* a: animations)
+        a->writeBack();
+    for (AnimationInstance* i: instances)
+        i->writeBack();
+}
+
+void Animation::benchmark(size_t models, size_t bones, int runs){
+    // Skeletons side by side under one root, each bone of each one animated by its own clip
+    Scene scene;
+    Node* root = new Node("root", glm::mat4(1.f), &scene);
+    scene.setRootNode(root);
+    
+    std::vector<Animation*> animations;
+    for (size_t m = 0; m < models; m++){
+        Animation* a = new Animation("crowd" + std::to_string(m), 200, 25);
+        Node* parent = new Node("model" + std::to_string(m), glm::translate(glm::mat4(1.f), glm::vec3(m % 20, 0.f, m / 20)), &scene, root);
+        root->addChild(parent->name(), parent);
+        for (size_t b = 0; b < bones; b++){
+            glm::mat4 offset(1.f);
+            offset[1][3] = 1.f;
+            Node* n = new Node(parent->name() + "_bone" + std::to_string(b), offset, &scene, parent);
+            parent->addChild(n->name(), n);
+            
+            Channel* c = new Channel(n);
+            for (int k = 0; k <= 20; k++){
+                float t = k * 10.f + (m % 7);
+                c->addRotationKey(t, glm::angleAxis(glm::radians(30.f * sinf(t * 0.1f + b)), glm::vec3(0.f, 0.f, 1.f)));
+            }
+            c->addPositionKey(0, glm::vec3(0.f, 1.f, 0.f));
+            c->addPositionKey(200, glm::vec3(0.f, 1.f, 0.f));
+            c->addScaleKey(0, glm::vec3(1.f));
+            c->addScaleKey(200, glm::vec3(1.f));
+            a->addChannel(c);
+            parent = n;
+        }
+        animations.push_back(a);
+    }
+    
+    std::cout << "Animating " << models << " synthetic chains of " << bones << " bones, " << runs << " runs (ms per frame):" << std::endl;
+    
+    double start = Profiler::now();
+    for (int i = 0; i < runs; i++)
+        for (Animation* a: animations)
+            a->applyBones(fmod(a->timeInTick(i / 60.f), a->duration()));
+    std::cout << std::setw(32) << "single-threaded flat sampling" << std::setw(14) << std::fixed << std::setprecision(3) << (Profiler::now() - start) / runs << std::endl;
+    
+    unsigned hardware = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<AnimationInstance*> none;
+    for (unsigned threads = 1; ; threads = std::min(threads * 2, hardware)){
+        JobSystem::start(threads - 1);
+        start = Profiler::now();
+        for (int i = 0; i < runs; i++)
+            play(animations, none, i / 60.f);
+        std::cout << std::setw(32) << "play x" + std::to_string(threads) << std::setw(14) << (Profiler::now() - start) / runs << std::endl;
+        if (threads == hardware)
+            break;
+    }
+    
+    for (Animation* a: animations)
+        delete a;
+}
+
+
+float BakedAnimation::RATE = 0.f;
+
+BakedAnimation::BakedAnimation(Animation* a, float rate):
+    _animation(a),
+    _rate(rate),
+    _length(a->duration() / a->tickPerSec()),
+    _frames(std::max(1, (int)ceilf(_length * rate))),
+    _nodes(),
+    _palette(),
+    _texture(0)
+{
+    if (!a->_bound)
+        a->bind();
+    for (Channel* c: a->_channels)
+        _nodes.push_back(c->node());
+    
+    _palette.resize(_frames * _nodes.size());
+    for (int f = 0; f < _frames && !_nodes.empty(); f++){
+        a->sample(f / rate * a->tickPerSec(), 0, _nodes.size());
+        std::copy(a->_pose.begin(), a->_pose.end(), _palette.begin() + f * _nodes.size());
+    }
+    DEBUG(Debug::Info, "Baked %s: %d frames of %d nodes, %d KiB\n", a->name().c_str(), _frames, (int)_nodes.size(), (int)(bytes() / 1024));
+}
+
+BakedAnimation::~BakedAnimation(){
+    if (_texture){
+        Texture::activeUnit(Texture::EDIT_UNIT);
+        Texture::bindTexture(GL_TEXTURE_2D, 0);
+        glDeleteTextures(1, &_texture);
+    }
+}
+
+void BakedAnimation::pose(float timeInSeconds, glm::mat4* out) const {
+    float t = fmodf(timeInSeconds, _length);
+    if (t < 0.f)
+        t += _length;
+    
+    // The last frame blends back into the first over what is left of the clip
+    int f = std::min((int)(t * _rate), _frames - 1);
+    float span = std::min(1.f / _rate, _length - f / _rate);
+    float factor = span > 0.f ? glm::clamp((t - f / _rate) / span, 0.f, 1.f) : 0.f;
+    
+    const glm::mat4* from = &_palette[f * _nodes.size()];
+    const glm::mat4* to = &_palette[(f + 1) % _frames * _nodes.size()];
+    for (size_t n = 0; n < _nodes.size(); n++)
+        out[n] = from[n] + (to[n] - from[n]) * factor;
+}
+
+GLuint BakedAnimation::texture(){
+    if (_texture || _palette.empty())
+        return _texture;
+    
+    glGenTextures(1, &_texture);
+    Texture::activeUnit(Texture::EDIT_UNIT);
+    Texture::bindTexture(GL_TEXTURE_2D, _texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, _nodes.size() * 4, _frames, 0, GL_RGBA, GL_FLOAT, &_palette[0]);
+    // Read with texelFetch, no filtering between nodes
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+    Texture::bindTexture(GL_TEXTURE_2D, 0);
+    GL_CHECK("BakedAnimation::texture");
+    return _texture;
+}
+
+AnimationInstance::AnimationInstance(BakedAnimation* clip, float offset, Node* root):
+    _clip(clip),
+    _offset(offset),
+    _targets(clip->nodes()),
+    _pose(clip->nodes().size()),
+    _lod()
+{
+    if (root)
+        for (Node*& n: _targets)
+            n = root->find(n->name());
+    for (Node* n: _targets)
+        if (n){
+            _lod.setAnchor(n);
+            break;
+        }
+}
+
+void AnimationInstance::apply(float timeInSeconds){
+    sample(timeInSeconds);
+    writeBack();
+}
+
+void AnimationInstance::sample(float timeInSeconds){
+    if (!_pose.empty())
+        _clip->pose(timeInSeconds + _offset, &_pose[0]);
+}
+
+void AnimationInstance::writeBack(){
+    for (size_t n = 0; n < _targets.size(); n++)
+        if (_targets[n])
+            _targets[n]->setTransformation(_pose[n]);
+}
@@ -17,97 +17,341 @@
 
 class KeyFrame;
 class Animation;
+class AnimationInstance;
+class Camera;
 class NodeAnimator;
 class Node;
 class Bone;
-class Key;
 class Scene;
 
-class Key {
+/**!
+ * \short How often a playing animation is sampled, from the size on screen of what it moves
+ * Animations of small or far objects are sampled every few frames, those out of
+ * the view every \ref MAX_INTERVAL frames, so that one moving its anchor back
+ * into view is noticed; their time keeps running, so they resume where they
+ * would be. Each one gets its own phase so that throttled animations spread
+ * over the frames instead of all being sampled on the same one.
+ */
+class AnimationLOD {
     public:
-        virtual glm::mat4 value() const = 0;
-};
-
-class PositionKey : public Key {
-    public:
-        PositionKey(glm::vec3 value): _value(value)
-        {}
-        inline glm::mat4 value() const { return glm::translate(glm::mat4(1.f), _value); }
-        inline glm::vec3 position() const { return _value; }
+        AnimationLOD(Node* anchor = nullptr);
+        
+        /**!
+         * \short Node whose meshes and children are tested against the view
+         */
+        void setAnchor(Node* anchor);
+        
+        /**!
+         * \short Whether the animation is to be sampled on that frame, always without an anchor
+         */
+        bool due(const glm::mat4& viewProjection, const glm::vec3& eye, unsigned frame);
+        
+        inline int interval() const { return _interval; }
+        inline bool visible() const { return _visible; }
+        
+        static bool ENABLED;
+        static float FULL_RATE_SIZE;    // radius over distance from which every frame is sampled
+        static int MAX_INTERVAL;        // frames between two samples of the smallest animations
     private:
-        glm::vec3 _value;
+        /**!
+         * \short Add the nodes holding meshes, n and those below it, with the radius of their meshes
+         */
+        static void _collect(Node* n, std::vector<std::pair<Node*, float>>& spheres);
+        
+        Node* _anchor;
+        std::vector<std::pair<Node*, float>> _spheres;  // tested each on its own, see Node::draw for why
+        unsigned _phase;
+        int _interval;
+        bool _visible;
+        
+        static unsigned NEXT_PHASE;
 };
 
-class ScaleKey : public Key {
+/**!
+ * \short Translation, rotation and scale keys of one node
+ * Keys are staged while the channel is built; once given to an \ref Animation
+ * they are moved into the animation block and read from there as plain
+ * arrays of times and values.
+ */
+class Channel {
+    friend class Animation;
     public:
-        ScaleKey(glm::vec3 value): _value(value)
-        {}
-        inline glm::mat4 value() const { return glm::scale(glm::mat4(1.f), _value); }
-        inline glm::vec3 dimenssion() const { return _value; }
-    private:
-        glm::vec3 _value;
-};
+        Channel(Node* n, std::vector<Bone*> b = std::vector<Bone*>()): _bones(b), _node(n) {}
 
-class RotationKey : public Key {
-    public:
-        RotationKey(glm::quat value);
-        inline glm::mat4 value() const { return glm::toMat4(_value); }
-        inline glm::quat rotation() const { return _value; }
-    private:
-        glm::quat _value;
-};
+        /**!
+         * \short Add a key, a second key at the same time is ignored
+         * Keys are to be added before the channel goes to its animation.
+         */
+        void addPositionKey(float t, glm::vec3 position);
+        void addRotationKey(float t, glm::quat rotation);
+        void addScaleKey(float t, glm::vec3 scale);
 
-class Channel {
-    public:
-        Channel(Node* n, std::vector<Bone*> b = std::vector<Bone*>()): _node(n), _bones(b), _positions_keys(), _rotations_keys(), _scales_keys() {}
-        
-        void addKey(float t, PositionKey* k) {
-            _positions_keys.insert(std::make_pair(t, k));                
-        }
-        void addKey(float t, RotationKey* k) {
-            _rotations_keys.insert(std::make_pair(t, k));                
-        }
-        void addKey(float t, ScaleKey* k) {
-            _scales_keys.insert(std::make_pair(t, k));                
-        }
-        
-        void applyBones(float AnimationTime, glm::mat4& currentTransformation, const glm::mat4& GlobalInverseTransform);
-        
-        std::pair<std::pair<float, PositionKey*>, std::pair<float, PositionKey*>> getPosKeys(float AnimationTime) const;
-        std::pair<std::pair<float, RotationKey*>, std::pair<float, RotationKey*>> getRotKeys(float AnimationTime) const;
-        std::pair<std::pair<float, ScaleKey*>, std::pair<float, ScaleKey*>> getScaKeys(float AnimationTime) const;
-    
+        /**!
+         * \short Local transformation of the node at AnimationTime
+         * \param pose Transformation of the node from the root, the keys apply around it
+         * \param inverse Inverse of pose
+         */
+        glm::mat4 transformation(float AnimationTime, const glm::mat4& pose, const glm::mat4& inverse) const;
+
+        glm::vec3 position(float AnimationTime) const;
+        glm::quat rotation(float AnimationTime) const;
+        glm::vec3 scale(float AnimationTime) const;
+
+        inline size_t keyCount() const { return _positions.count + _rotations.count + _scales.count; }
         inline Node* node() const { return _node; }
     private:
-        std::map<float, PositionKey*> _positions_keys;
-        std::map<float, RotationKey*> _rotations_keys;
-        std::map<float, ScaleKey*> _scales_keys;
+        template <class T>
+        struct Track {
+            const float* times;
+            const T* values;
+            const uint16_t* quantized;  // 3 per key instead of values when compressed
+            glm::vec3 origin, extent;   // range of quantized vectors
+            bool compressed;
+            size_t count;
+            mutable size_t cursor;      // key found by the last lookup
+            std::vector<std::pair<float, T>> pending;  // sorted, until packed
+
+            Track(): times(nullptr), values(nullptr), quantized(nullptr), origin(0.f), extent(0.f), compressed(false), count(0), cursor(0), pending() {}
+        };
+        
+        /**!
+         * \short Key k of a track, dequantized when compressed
+         */
+        static glm::vec3 _value(const Track<glm::vec3>& track, size_t k);
+        static glm::quat _value(const Track<glm::quat>& track, size_t k);
+        
+        /**!
+         * \short 16 bits per component relative to the range of the keys, smallest three for quaternions
+         */
+        static void _quantize(Track<glm::vec3>& track, const std::vector<std::pair<float, glm::vec3>>& keys, uint16_t* out);
+        static void _quantize(Track<glm::quat>& track, const std::vector<std::pair<float, glm::quat>>& keys, uint16_t* out);
+        
+        /**!
+         * \short Drop the keys that linear interpolation of their neighbours gives back within tolerance
+         * \param error Distance between two values, in the unit of tolerance
+         */
+        template <class T, class E>
+        static std::vector<std::pair<float, T>> _reduce(const std::vector<std::pair<float, T>>& keys, float tolerance, E error);
+        
+        template <class T>
+        static std::vector<std::pair<float, T>> _keys(const Track<T>& track);
+        
+        /**!
+         * \short Value at AnimationTime, held at both ends of the track
+         */
+        template <class T>
+        static T _sample(const Track<T>& track, float AnimationTime);
+
+        template <class T>
+        static void _insert(Track<T>& track, float t, const T& value);
+
+        /**!
+         * \short Index of the key before AnimationTime, whose next key is after it, -1 when there is none
+         * Playing forward only ever moves the cursor to the next key, anything else is a binary search.
+         */
+        static int _find(const float* times, size_t count, size_t& cursor, float AnimationTime);
+
+        /**!
+         * \short Bytes needed by the track, keys already packed and pending ones
+         */
+        template <class T>
+        static size_t _bytes(const Track<T>& track);
+
+        /**!
+         * \short Write times then values at out, point the track at them
+         * \return Past the last byte written
+         */
+        template <class T>
+        static unsigned char* _pack(Track<T>& track, unsigned char* out);
+
+        Track<glm::vec3> _positions;
+        Track<glm::quat> _rotations;
+        Track<glm::vec3> _scales;
         std::vector<Bone*> _bones;
         Node* _node;
 };
 
 class Animation {
+    friend class BakedAnimation;
     public:
-        Animation(std::string name, double duration, double tick_per_sec): 
-            _name(name),
-            _duration(duration),
-            _tick_per_sec(tick_per_sec) {}
-            
-        void addChannel(Channel* c) { _channel.insert(std::make_pair(c->node(), c)); } 
+        Animation(std::string name, double duration, double tick_per_sec);
+        ~Animation();
+
+        void addChannel(Channel* c) { _channel.insert(std::make_pair(c->node(), c)); _packed = _bound = false; }
+
+        /**!
+         * \short Resolve the nodes of the channels and keep their pose, done once when the animation starts
+         * Channels are ordered parents first. Keys apply around the poses the nodes have at that time.
+         */
+        void bind();
         
-        void applyBones(float AnimationTime, Scene* s);
+        /**!
+         * \short Sample and write back every channel on the caller
+         */
+        void applyBones(float AnimationTime);
         
+        /**!
+         * \short Local transformations of the channels [begin, end) at AnimationTime, kept until \ref writeBack
+         * Reads no node, so that channels can be sampled from several threads at once.
+         */
+        void sample(float AnimationTime, size_t begin, size_t end);
+        
+        /**!
+         * \short Give the sampled transformations to their nodes
+         */
+        void writeBack();
+        
+        inline size_t channelCount() const { return _channels.size(); }
+        inline AnimationLOD& lod() { return _lod; }
+
         inline float tickPerSec() const { return _tick_per_sec != 0. ? _tick_per_sec : 25.0f; }
         inline float timeInTick(float TimeInSeconds) const { return TimeInSeconds * _tick_per_sec; }
         inline float duration() const { return _duration; }
         inline std::string name() const { return _name; }
+
+        size_t keyCount() const;
+        
+        /**!
+         * \short Remove keys interpolation gives back and quantize the others
+         * \param tolerance Largest error allowed at the end of any chain of animated nodes, in scene units
+         * Rotations are held to the angle moving the farthest child node by that much. The
+         * tolerance is shared by the animated nodes of a chain since their errors add up.
+         */
+        void compress(float tolerance);
+        
+        static float COMPRESSION_TOLERANCE;     // applied at import, 0 to keep keys as they are
+
+        /**!
+         * \short Bytes used by the keys of every animation, against their former heap objects in maps
+         */
+        static void memoryReport();
+        
+        /**!
+         * \short Sample these animations and instances on the job system, then write them back on the caller
+         * Animations loop over their duration. Channels of all animations are split together, so that
+         * many small animations keep every thread busy.
+         * \param camera Skip the animations its view does not need this frame, see AnimationLOD
+         */
+        static void play(const std::vector<Animation*>& animations, const std::vector<AnimationInstance*>& instances, float timeInSeconds,
+                         const Camera* camera = nullptr);
+        
+        /**!
+         * \short Print milliseconds per frame of a crowd of animated skeletons, sampled single-threaded then with play on 1 to all threads
+         * The skeletons are synthetic chains of bones, not the imported scene; the single-threaded row already uses the flat
+         * channel array, the tree walk it replaced is gone.
+         */
+        static void benchmark(size_t models = 300, size_t bones = 24, int runs = 20);
+        
+        static size_t GRAIN;    // channels per job
     private:
-        void _recusive_bones(Node* n, Scene* s, const glm::mat4& globalInverseTransform, const glm::mat4& ParentTransform, float AnimationTime);
+        /**!
+         * \short Move the keys of all channels into one block, channel after channel
+         */
+        void _pack();
+        
+        /**!
+         * \short Animated nodes on the longest chain of animated nodes going through n
+         */
+        int _chainLength(Node* n) const;
+        int _animatedBelow(Node* n) const;
+        
+        /**!
+         * \short Length of the longest path from n to a node below it
+         */
+        static float _reach(Node* n);
         
         std::string _name;
         std::map<Node*, Channel*> _channel;
         double _tick_per_sec;
         double _duration;
+
+        std::vector<unsigned char> _block;
+        bool _packed;
+        
+        bool _bound;
+        std::vector<Channel*> _channels;    // parents first, set by bind
+        std::vector<glm::mat4> _bind_pose, _bind_inverse;
+        std::vector<glm::mat4> _pose;       // sampled, one per channel
+        AnimationLOD _lod;
+        
+        static unsigned FRAME;      // calls to play, for the LOD phases
+
+        static std::vector<Animation*> INSTANCES;
+};
+
+/**!
+ * \short Node transformations of an animation sampled at a fixed rate
+ * Playing it is a lookup of the two frames around the time and a linear blend
+ * of their matrices, with no key search. Frames are taken around the poses
+ * of \ref Animation::bind, in its channel order, and the clip loops from its
+ * last frame back to its first. Any number of \ref AnimationInstance
+ * can share one.
+ */
+class BakedAnimation {
+    public:
+        /**!
+         * \param rate Frames per second of animation time
+         */
+        BakedAnimation(Animation* a, float rate);
+        ~BakedAnimation();
+        
+        /**!
+         * \short Blended node transformations at that time, in the order of \ref nodes
+         */
+        void pose(float timeInSeconds, glm::mat4* out) const;
+        
+        inline const std::vector<Node*>& nodes() const { return _nodes; }
+        inline Animation* animation() const { return _animation; }
+        inline int frames() const { return _frames; }
+        inline float rate() const { return _rate; }
+        inline size_t bytes() const { return _palette.size() * sizeof(glm::mat4); }
+        
+        /**!
+         * \short The frames as a GL_RGBA32F texture, created on first call
+         * One row per frame, four texels per node holding the columns of its matrix.
+         */
+        GLuint texture();
+        
+        static float RATE;      // frames per second scenes bake their animations at, 0 to play from the keys
+    private:
+        Animation* _animation;
+        float _rate;
+        float _length;                  // seconds
+        int _frames;
+        std::vector<Node*> _nodes;
+        std::vector<glm::mat4> _palette;    // frame after frame, a matrix per node
+        GLuint _texture;
+};
+
+/**!
+ * \short One playback of a baked animation, on its own nodes and at its own time
+ */
+class AnimationInstance {
+    public:
+        /**!
+         * \param offset Seconds added to the scene time
+         * \param root Play on the nodes of that name under root instead of the baked ones
+         */
+        AnimationInstance(BakedAnimation* clip, float offset = 0.f, Node* root = nullptr);
+        
+        void apply(float timeInSeconds);
+        
+        /**!
+         * \short apply split in two, sample only reading the clip so that instances can be sampled in parallel
+         */
+        void sample(float timeInSeconds);
+        void writeBack();
+        
+        inline BakedAnimation* clip() const { return _clip; }
+        inline float offset() const { return _offset; }
+        inline void setOffset(float offset) { _offset = offset; }
+        inline AnimationLOD& lod() { return _lod; }
+    private:
+        BakedAnimation* _clip;
+        float _offset;
+        std::vector<Node*> _targets;    // null for the nodes not found under root
+        std::vector<glm::mat4> _pose;
+        AnimationLOD _lod;
 };
 
 #endif
@@ -25,16 +25,9 @@ ControlableCamera::ControlableCamera(Window*p, bool restricted):
     _speed(1.0f), _mouseSpeed(0.005f), _restricted_box(restricted)
 {}
 
-void ControlableCamera::updateFromMouse(){
+void ControlableCamera::updateFromMouse(float deltaTime){
     if (!parent())
         throw new OpenGLException("Camera has no parent window.", 0);
-    
-	// glfwGetTime is called only once, the first time this function is called
-	static double lastTime = glfwGetTime();
-
-	// Compute time difference between current and last frame
-    double currentTime = glfwGetTime();
-	float deltaTime = float(currentTime - lastTime);
 
 	// Get mouse position
 	double xpos, ypos;
@@ -122,7 +115,4 @@ void ControlableCamera::updateFromMouse(){
 								_position+direction, // and looks here : at the same position, plus "direction"
 								up                  // Head is up (set to 0,-1,0 to look upside-down)
 						   ));
-
-	// For the next frame, the "last time" will be "now"
-	lastTime = currentTime;
 }
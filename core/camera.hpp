@@ -44,7 +44,10 @@ class Camera {
 class ControlableCamera: public Camera {
     public:
         ControlableCamera(Window*p = nullptr, bool restricted = false);
-        void updateFromMouse();
+        /**!
+         * \short Turn with the mouse and move with the arrow keys for deltaTime seconds
+         */
+        void updateFromMouse(float deltaTime);
         
         inline void setPosition(glm::vec3 p){ _position = p; }
         inline glm::vec3 position() const { return _position; }
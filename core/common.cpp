@@ -17,3 +17,58 @@ std::ostream& operator<<(std::ostream& cout, const glm::vec4& m){
     cout << '[' << m.x << ", " << m.y << ", " << m.z << ", " << m.w << ']' << std::endl;
     return cout;
 }
+
+namespace Debug {
+    GLErrorMode GL_ERROR_MODE = GLErrorsAsync;
+    
+    const char* GL_CHECK_LABEL = "startup";
+    const char* GL_CHECK_FILE = __FILE__;
+    int GL_CHECK_LINE = 0;
+    
+    static const char* glDebugSourceName(GLenum source){
+        switch (source){
+        case GL_DEBUG_SOURCE_API:             return "API";
+        case GL_DEBUG_SOURCE_WINDOW_SYSTEM:   return "Window system";
+        case GL_DEBUG_SOURCE_SHADER_COMPILER: return "Shader compiler";
+        case GL_DEBUG_SOURCE_THIRD_PARTY:     return "Third party";
+        case GL_DEBUG_SOURCE_APPLICATION:     return "Application";
+        default:                              return "Other";
+        }
+    }
+    
+    static const char* glDebugTypeName(GLenum type){
+        switch (type){
+        case GL_DEBUG_TYPE_ERROR:               return "error";
+        case GL_DEBUG_TYPE_DEPRECATED_BEHAVIOR: return "deprecated";
+        case GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR:  return "undefined behavior";
+        case GL_DEBUG_TYPE_PORTABILITY:         return "portability";
+        case GL_DEBUG_TYPE_PERFORMANCE:         return "performance";
+        default:                                return "other";
+        }
+    }
+    
+    static void GLAPIENTRY glDebugCallback(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar* message, const void* user){
+        if (severity == GL_DEBUG_SEVERITY_NOTIFICATION)
+            return;
+            
+        // Exceptions must not cross the driver, strict mode throws from GL_CHECK instead
+        Level priority = (type == GL_DEBUG_TYPE_ERROR || severity == GL_DEBUG_SEVERITY_HIGH) ? Error : Warning;
+        DEBUG(priority, "[GL %s %s #%u] %s\n    near '%s' (%s:%d)\n", glDebugSourceName(source), glDebugTypeName(type), id, message, 
+              GL_CHECK_LABEL, GL_CHECK_FILE, GL_CHECK_LINE);
+    }
+    
+    bool InstallGLDebugCallback(){
+        if (GLEW_KHR_debug){
+            glEnable(GL_DEBUG_OUTPUT);
+            if (GL_ERROR_MODE == GLErrorsStrict)
+                glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+            glDebugMessageCallback(glDebugCallback, nullptr);
+        } else if (GLEW_ARB_debug_output){
+            if (GL_ERROR_MODE == GLErrorsStrict)
+                glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS_ARB);
+            glDebugMessageCallbackARB(glDebugCallback, nullptr);
+        } else
+            return false;
+        return true;
+    }
+}
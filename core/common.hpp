@@ -34,13 +34,55 @@ std::ostream& operator<<(std::ostream& cout, const glm::mat4& m);
 namespace Debug {
     enum Level {Verbose, Info, Warning, Error};
     
+    /**!
+     * \short How OpenGL errors are caught
+     * GLErrorsAsync routes them through the KHR_debug message callback and never
+     * stalls the pipeline, GLErrorsStrict polls glGetError at every GL_CHECK and
+     * throws, which is only meant for debugging.
+     */
+    enum GLErrorMode {GLErrorsOff, GLErrorsAsync, GLErrorsStrict};
+    
+    extern GLErrorMode GL_ERROR_MODE;
+    
+    // Last GL_CHECK reached, reported by the debug callback as the nearest source location
+    extern const char* GL_CHECK_LABEL;
+    extern const char* GL_CHECK_FILE;
+    extern int GL_CHECK_LINE;
+    
     inline void CheckOpenGLError(std::string label){   
         GLenum err;     
         while ((err = glGetError()) != GL_NO_ERROR)
             throw new OpenGLException(label, err);
     }
+    
+    inline void CheckOpenGLError(const char* label, const char* file, int line){   
+        GLenum err;     
+        while ((err = glGetError()) != GL_NO_ERROR)
+            throw new OpenGLException(std::string(label) + " (" + file + ":" + std::to_string(line) + ")", err);
+    }
+    
+    /**!
+     * \short Install the debug message callback on the current context
+     * \return false if neither KHR_debug nor ARB_debug_output is available
+     */
+    bool InstallGLDebugCallback();
 }
 
+#ifdef NO_GL_CHECK
+#define GL_CHECK(label)
+#else
+#define GL_CHECK(label)                                                \
+    do {                                                               \
+        if (Debug::GL_ERROR_MODE == Debug::GLErrorsStrict)             \
+            Debug::CheckOpenGLError(label, __FILE__, __LINE__);        \
+        else {                                                         \
+            Debug::GL_CHECK_LABEL = label;                             \
+            Debug::GL_CHECK_FILE = __FILE__;                           \
+            Debug::GL_CHECK_LINE = __LINE__;                           \
+        }                                                              \
+    } while (0)
+#endif
+
 #define DEBUG(priority,format,args...)                                 \
                  if (priority > Debug::Info)                           \
                     fprintf(stderr, format, ## args);                  \
@@ -0,0 +1,540 @@
+#include "compressed.hpp"
+#include "texture.hpp"
+#include "common.hpp"
+#include "jobs.hpp"
+
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <dirent.h>
+
+#include <stb_image.h>
+
+#define DDS_MAGIC 0x20534444 // "DDS "
+#define DDSD_CAPS 0x1
+#define DDSD_HEIGHT 0x2
+#define DDSD_WIDTH 0x4
+#define DDSD_PIXELFORMAT 0x1000
+#define DDSD_MIPMAPCOUNT 0x20000
+#define DDSD_LINEARSIZE 0x80000
+#define DDPF_FOURCC 0x4
+#define DDSCAPS_COMPLEX 0x8
+#define DDSCAPS_TEXTURE 0x1000
+#define DDSCAPS_MIPMAP 0x400000
+#define DDSCAPS2_CUBEMAP 0x200
+#define DDSCAPS2_CUBEMAP_ALLFACES 0xFC00
+#define DDS_RESOURCE_MISC_TEXTURECUBE 0x4
+
+// DXGI_FORMAT values found in DX10 headers
+#define DXGI_BC1_UNORM 71
+#define DXGI_BC1_UNORM_SRGB 72
+#define DXGI_BC3_UNORM 77
+#define DXGI_BC3_UNORM_SRGB 78
+#define DXGI_BC5_UNORM 83
+#define DXGI_BC7_UNORM 98
+#define DXGI_BC7_UNORM_SRGB 99
+
+struct DDSPixelFormat {
+    uint32_t size, flags, fourCC, rgbBitCount, rMask, gMask, bMask, aMask;
+};
+
+struct DDSHeader {
+    uint32_t size, flags, height, width, pitchOrLinearSize, depth, mipMapCount;
+    uint32_t reserved1[11];
+    DDSPixelFormat pixelFormat;
+    uint32_t caps, caps2, caps3, caps4, reserved2;
+};
+
+struct DDSHeaderDX10 {
+    uint32_t dxgiFormat, resourceDimension, miscFlag, arraySize, miscFlags2;
+};
+
+struct KTXHeader {
+    unsigned char identifier[12];
+    uint32_t endianness, glType, glTypeSize, glFormat, glInternalFormat, glBaseInternalFormat;
+    uint32_t pixelWidth, pixelHeight, pixelDepth, numberOfArrayElements, numberOfFaces, numberOfMipmapLevels;
+    uint32_t bytesOfKeyValueData;
+};
+
+static const unsigned char KTX_IDENTIFIER[12] = {0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n'};
+
+static std::string extension(const std::string& path){
+    size_t dot = path.rfind('.');
+    if (dot == std::string::npos)
+        return "";
+    std::string ext = path.substr(dot + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext;
+}
+
+bool CompressedImage::isCompressedPath(const std::string& path){
+    std::string ext = extension(path);
+    return ext == "dds" || ext == "ktx";
+}
+
+size_t CompressedImage::blockBytes(GLenum format){
+    switch (format){
+    case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+    case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+        return 8;
+    default:
+        return 16;
+    }
+}
+
+size_t CompressedImage::levelBytes(GLenum format, int width, int height){
+    return (size_t)std::max(1, (width + 3) / 4) * std::max(1, (height + 3) / 4) * blockBytes(format);
+}
+
+size_t CompressedImage::size() const {
+    size_t total = 0;
+    for (const Level& l: levels)
+        total += l.data.size();
+    return total;
+}
+
+bool CompressedImage::supported(GLenum format){
+    switch (format){
+    case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+    case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+    case GL_COMPRESSED_RGBA_S3TC_DXT3_EXT:
+    case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+        return GLEW_EXT_texture_compression_s3tc;
+    case GL_COMPRESSED_RG_RGTC2:
+        return true;    // core since OpenGL 3.0
+    case GL_COMPRESSED_RGBA_BPTC_UNORM:
+    case GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM:
+        return GLEW_ARB_texture_compression_bptc;
+    default:
+        return false;
+    }
+}
+
+bool CompressedImage::_loadDDS(std::ifstream& file, CompressedImage* image, GLenum* format, int* top_width, int* top_height){
+    uint32_t magic;
+    DDSHeader header;
+    file.read((char*)&magic, sizeof(magic));
+    file.read((char*)&header, sizeof(header));
+    if (!file || magic != DDS_MAGIC || header.size != sizeof(DDSHeader))
+        return false;
+
+    if (!(header.pixelFormat.flags & DDPF_FOURCC))
+        return false;
+
+    switch (header.pixelFormat.fourCC){
+    case FOURCC_DXT1:
+        *format = GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+        break;
+    case FOURCC_DXT3:
+        *format = GL_COMPRESSED_RGBA_S3TC_DXT3_EXT;
+        break;
+    case FOURCC_DXT5:
+        *format = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+        break;
+    case FOURCC_ATI2:
+    case FOURCC_BC5U:
+        *format = GL_COMPRESSED_RG_RGTC2;
+        break;
+    case FOURCC_DX10: {
+        DDSHeaderDX10 dx10;
+        file.read((char*)&dx10, sizeof(dx10));
+        switch (dx10.dxgiFormat){
+        case DXGI_BC1_UNORM:
+        case DXGI_BC1_UNORM_SRGB:
+            *format = GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+            break;
+        case DXGI_BC3_UNORM:
+        case DXGI_BC3_UNORM_SRGB:
+            *format = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+            break;
+        case DXGI_BC5_UNORM:
+            *format = GL_COMPRESSED_RG_RGTC2;
+            break;
+        case DXGI_BC7_UNORM:
+            *format = GL_COMPRESSED_RGBA_BPTC_UNORM;
+            break;
+        case DXGI_BC7_UNORM_SRGB:
+            *format = GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM;
+            break;
+        default:
+            DEBUG(Debug::Error, "Unsupported DXGI format %u\n", dx10.dxgiFormat);
+            return false;
+        }
+        break;
+    }
+    default:
+        DEBUG(Debug::Error, "Unsupported DDS FourCC %08x\n", header.pixelFormat.fourCC);
+        return false;
+    }
+
+    if (top_width)
+        *top_width = header.width;
+    if (top_height)
+        *top_height = header.height;
+    if (!image)
+        return true;
+
+    image->format = *format;
+    image->faces = (header.caps2 & DDSCAPS2_CUBEMAP_ALLFACES) == DDSCAPS2_CUBEMAP_ALLFACES ? 6 : 1;
+    int count = (header.flags & DDSD_MIPMAPCOUNT) ? std::max<uint32_t>(1, header.mipMapCount) : 1;
+    for (int f = 0; f < image->faces; f++){
+        int width = header.width, height = header.height;
+        for (int l = 0; l < count; l++){
+            Level level;
+            level.width = width;
+            level.height = height;
+            level.data.resize(levelBytes(*format, width, height));
+            file.read((char*)&level.data[0], level.data.size());
+            if (!file)
+                return false;
+            image->levels.push_back(level);
+
+            width = std::max(1, width / 2);
+            height = std::max(1, height / 2);
+        }
+    }
+    return true;
+}
+
+bool CompressedImage::_loadKTX(std::ifstream& file, CompressedImage* image, GLenum* format, int* top_width, int* top_height){
+    KTXHeader header;
+    file.read((char*)&header, sizeof(header));
+    if (!file || memcmp(header.identifier, KTX_IDENTIFIER, sizeof(KTX_IDENTIFIER)))
+        return false;
+
+    // Only compressed 2D textures written in our byte order
+    if (header.endianness != 0x04030201 || header.glType != 0 || header.numberOfFaces != 1 || header.pixelDepth > 1){
+        DEBUG(Debug::Error, "Unsupported KTX layout\n");
+        return false;
+    }
+    *format = header.glInternalFormat;
+
+    if (top_width)
+        *top_width = header.pixelWidth;
+    if (top_height)
+        *top_height = header.pixelHeight;
+    if (!image)
+        return true;
+
+    image->format = *format;
+    file.seekg(header.bytesOfKeyValueData, std::ios::cur);
+
+    int width = header.pixelWidth, height = header.pixelHeight;
+    for (uint32_t l = 0; l < std::max<uint32_t>(1, header.numberOfMipmapLevels); l++){
+        uint32_t size;
+        file.read((char*)&size, sizeof(size));
+
+        Level level;
+        level.width = width;
+        level.height = height;
+        level.data.resize(size);
+        file.read((char*)&level.data[0], size);
+        file.seekg(3 - (size + 3) % 4, std::ios::cur);
+        if (!file)
+            return false;
+        image->levels.push_back(level);
+
+        width = std::max(1, width / 2);
+        height = std::max(1, height / 2);
+    }
+    return true;
+}
+
+bool CompressedImage::load(const std::string& path, CompressedImage& image){
+    std::ifstream file(path, std::ios::binary);
+    GLenum format;
+    bool ok = extension(path) == "ktx" ? _loadKTX(file, &image, &format, nullptr, nullptr) : _loadDDS(file, &image, &format, nullptr, nullptr);
+    if (!ok)
+        DEBUG(Debug::Error, "Cannot read compressed texture %s\n", path.c_str());
+    return ok;
+}
+
+bool CompressedImage::readFormat(const std::string& path, GLenum* format, int* width, int* height){
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open())
+        return false;
+    return extension(path) == "ktx" ? _loadKTX(file, nullptr, format, width, height) : _loadDDS(file, nullptr, format, width, height);
+}
+
+bool CompressedImage::saveDDS(const std::string& path) const {
+    std::ofstream file(path, std::ios::binary);
+    if (!file.is_open() || levels.empty())
+        return false;
+
+    DDSHeader header;
+    memset(&header, 0, sizeof(header));
+    header.size = sizeof(DDSHeader);
+    header.flags = DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PIXELFORMAT | DDSD_MIPMAPCOUNT | DDSD_LINEARSIZE;
+    header.width = levels[0].width;
+    header.height = levels[0].height;
+    header.pitchOrLinearSize = levels[0].data.size();
+    header.mipMapCount = mipCount();
+    header.pixelFormat.size = sizeof(DDSPixelFormat);
+    header.pixelFormat.flags = DDPF_FOURCC;
+    header.caps = DDSCAPS_TEXTURE | (mipCount() > 1 ? DDSCAPS_COMPLEX | DDSCAPS_MIPMAP : 0);
+    if (faces == 6){
+        header.caps |= DDSCAPS_COMPLEX;
+        header.caps2 = DDSCAPS2_CUBEMAP | DDSCAPS2_CUBEMAP_ALLFACES;
+    }
+
+    DDSHeaderDX10 dx10;
+    memset(&dx10, 0, sizeof(dx10));
+    switch (format){
+    case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+    case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+        header.pixelFormat.fourCC = FOURCC_DXT1;
+        break;
+    case GL_COMPRESSED_RGBA_S3TC_DXT3_EXT:
+        header.pixelFormat.fourCC = FOURCC_DXT3;
+        break;
+    case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+        header.pixelFormat.fourCC = FOURCC_DXT5;
+        break;
+    case GL_COMPRESSED_RG_RGTC2:
+        header.pixelFormat.fourCC = FOURCC_ATI2;
+        break;
+    case GL_COMPRESSED_RGBA_BPTC_UNORM:
+    case GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM:
+        header.pixelFormat.fourCC = FOURCC_DX10;
+        dx10.dxgiFormat = format == GL_COMPRESSED_RGBA_BPTC_UNORM ? DXGI_BC7_UNORM : DXGI_BC7_UNORM_SRGB;
+        dx10.resourceDimension = 3;     // D3D10_RESOURCE_DIMENSION_TEXTURE2D
+        dx10.arraySize = 1;
+        dx10.miscFlag = faces == 6 ? DDS_RESOURCE_MISC_TEXTURECUBE : 0;
+        break;
+    default:
+        return false;
+    }
+
+    uint32_t magic = DDS_MAGIC;
+    file.write((const char*)&magic, sizeof(magic));
+    file.write((const char*)&header, sizeof(header));
+    if (header.pixelFormat.fourCC == FOURCC_DX10)
+        file.write((const char*)&dx10, sizeof(dx10));
+    for (const Level& l: levels)
+        file.write((const char*)&l.data[0], l.data.size());
+    return (bool)file;
+}
+
+static inline uint16_t to565(const unsigned char* c){
+    return ((c[0] >> 3) << 11) | ((c[1] >> 2) << 5) | (c[2] >> 3);
+}
+
+static inline void from565(uint16_t v, int* c){
+    c[0] = ((v >> 11) & 31) * 255 / 31;
+    c[1] = ((v >> 5) & 63) * 255 / 63;
+    c[2] = (v & 31) * 255 / 31;
+}
+
+void CompressedImage::_encodeColorBlock(const unsigned char block[16][4], unsigned char* out){
+    // Bounding box of the colors, inset by a sixteenth to reduce the error at the extremities
+    unsigned char lo[3] = {255, 255, 255}, hi[3] = {0, 0, 0};
+    for (int p = 0; p < 16; p++)
+        for (int c = 0; c < 3; c++){
+            lo[c] = std::min(lo[c], block[p][c]);
+            hi[c] = std::max(hi[c], block[p][c]);
+        }
+    for (int c = 0; c < 3; c++){
+        int inset = (hi[c] - lo[c]) >> 4;
+        lo[c] += inset;
+        hi[c] -= inset;
+    }
+
+    uint16_t c0 = to565(hi), c1 = to565(lo);
+    uint32_t indices = 0;
+    if (c0 < c1)
+        std::swap(c0, c1);
+
+    if (c0 != c1){
+        int palette[4][3];
+        from565(c0, palette[0]);
+        from565(c1, palette[1]);
+        for (int c = 0; c < 3; c++){
+            palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+            palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+        }
+
+        for (int p = 0; p < 16; p++){
+            int best = 0, bestError = 1 << 30;
+            for (int i = 0; i < 4; i++){
+                int error = 0;
+                for (int c = 0; c < 3; c++)
+                    error += (block[p][c] - palette[i][c]) * (block[p][c] - palette[i][c]);
+                if (error < bestError){
+                    bestError = error;
+                    best = i;
+                }
+            }
+            indices |= best << (2 * p);
+        }
+    }
+
+    out[0] = c0 & 0xFF;
+    out[1] = c0 >> 8;
+    out[2] = c1 & 0xFF;
+    out[3] = c1 >> 8;
+    for (int i = 0; i < 4; i++)
+        out[4 + i] = (indices >> (8 * i)) & 0xFF;
+}
+
+void CompressedImage::_encodeAlphaBlock(const unsigned char block[16][4], int channel, unsigned char* out){
+    int a0 = 0, a1 = 255;
+    for (int p = 0; p < 16; p++){
+        a0 = std::max<int>(a0, block[p][channel]);
+        a1 = std::min<int>(a1, block[p][channel]);
+    }
+
+    // a0 > a1 selects the eight values mode
+    int palette[8] = {a0, a1};
+    for (int i = 1; i < 7; i++)
+        palette[i + 1] = ((7 - i) * a0 + i * a1) / 7;
+
+    uint64_t indices = 0;
+    if (a0 != a1){
+        for (int p = 0; p < 16; p++){
+            int best = 0, bestError = 1 << 30;
+            for (int i = 0; i < 8; i++){
+                int error = std::abs(block[p][channel] - palette[i]);
+                if (error < bestError){
+                    bestError = error;
+                    best = i;
+                }
+            }
+            indices |= (uint64_t)best << (3 * p);
+        }
+    }
+
+    out[0] = a0;
+    out[1] = a1;
+    for (int i = 0; i < 6; i++)
+        out[2 + i] = (indices >> (8 * i)) & 0xFF;
+}
+
+CompressedImage CompressedImage::encode(const unsigned char* rgba, int width, int height, GLenum format){
+    CompressedImage image;
+    image.format = format;
+
+    std::vector<unsigned char> pixels(rgba, rgba + (size_t)width * height * 4);
+    for (;;){
+        Level level;
+        level.width = width;
+        level.height = height;
+        level.data.resize(levelBytes(format, width, height));
+
+        unsigned char* out = &level.data[0];
+        for (int by = 0; by < height; by += 4)
+            for (int bx = 0; bx < width; bx += 4){
+                // Edge blocks repeat the last row and column
+                unsigned char block[16][4];
+                for (int p = 0; p < 16; p++){
+                    int x = std::min(bx + p % 4, width - 1), y = std::min(by + p / 4, height - 1);
+                    memcpy(block[p], &pixels[((size_t)y * width + x) * 4], 4);
+                }
+
+                switch (format){
+                case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+                case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+                    _encodeColorBlock(block, out);
+                    break;
+                case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+                    _encodeAlphaBlock(block, 3, out);
+                    _encodeColorBlock(block, out + 8);
+                    break;
+                case GL_COMPRESSED_RG_RGTC2:
+                    _encodeAlphaBlock(block, 0, out);
+                    _encodeAlphaBlock(block, 1, out + 8);
+                    break;
+                }
+                out += blockBytes(format);
+            }
+        image.levels.push_back(level);
+
+        if (width == 1 && height == 1)
+            break;
+
+        // Next level with a 2x2 box filter
+        int w = std::max(1, width / 2), h = std::max(1, height / 2);
+        std::vector<unsigned char> next((size_t)w * h * 4);
+        for (int y = 0; y < h; y++)
+            for (int x = 0; x < w; x++)
+                for (int c = 0; c < 4; c++){
+                    int x0 = std::min(2 * x, width - 1), x1 = std::min(2 * x + 1, width - 1);
+                    int y0 = std::min(2 * y, height - 1), y1 = std::min(2 * y + 1, height - 1);
+                    next[((size_t)y * w + x) * 4 + c] = (pixels[((size_t)y0 * width + x0) * 4 + c] + pixels[((size_t)y0 * width + x1) * 4 + c]
+                                                       + pixels[((size_t)y1 * width + x0) * 4 + c] + pixels[((size_t)y1 * width + x1) * 4 + c] + 2) / 4;
+                }
+        pixels.swap(next);
+        width = w;
+        height = h;
+    }
+    return image;
+}
+
+int CompressedImage::convertDirectory(const std::string& directory){
+    std::vector<std::string> files;
+    DIR* dir = opendir(directory.c_str());
+    if (!dir){
+        DEBUG(Debug::Error, "Cannot open directory %s\n", directory.c_str());
+        return 0;
+    }
+    while (struct dirent* entry = readdir(dir))
+        if (extension(entry->d_name) == "png")
+            files.push_back(directory + "/" + entry->d_name);
+    closedir(dir);
+    std::sort(files.begin(), files.end());
+
+    struct Result {
+        GLenum format;
+        size_t raw, compressed;
+    };
+    std::vector<Result> results(files.size(), Result{0, 0, 0});
+
+    JobSystem::parallelFor(files.size(), 1, [&](size_t begin, size_t end){
+        for (size_t f = begin; f < end; f++){
+            int width, height, components;
+            unsigned char* data = stbi_load(files[f].c_str(), &width, &height, &components, 4);
+            if (!data)
+                continue;
+
+            bool alpha = false;
+            for (size_t p = 0; p < (size_t)width * height && !alpha; p++)
+                alpha = data[p * 4 + 3] != 255;
+
+            GLenum format = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+            if (files[f].find("_normal.") != std::string::npos)
+                format = GL_COMPRESSED_RG_RGTC2;
+            else if (alpha)
+                format = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+
+            CompressedImage image = encode(data, width, height, format);
+            stbi_image_free(data);
+
+            std::string output = files[f].substr(0, files[f].rfind('.')) + ".dds";
+            if (!image.saveDDS(output))
+                continue;
+
+            // Runtime footprint before: the decoded components plus generated mipmaps
+            results[f].format = format;
+            results[f].raw = (size_t)width * height * components * 4 / 3;
+            results[f].compressed = image.size();
+        }
+    });
+
+    int converted = 0;
+    size_t raw = 0, compressed = 0;
+    for (size_t f = 0; f < files.size(); f++){
+        if (!results[f].compressed){
+            DEBUG(Debug::Error, "Cannot convert %s\n", files[f].c_str());
+            continue;
+        }
+        const char* name = results[f].format == GL_COMPRESSED_RG_RGTC2 ? "BC5" : results[f].format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT ? "BC3" : "BC1";
+        std::cout << std::setw(40) << files[f] << std::setw(6) << name << std::setw(10) << results[f].raw / 1024 << " KiB ->"
+                  << std::setw(8) << results[f].compressed / 1024 << " KiB" << std::endl;
+        raw += results[f].raw;
+        compressed += results[f].compressed;
+        converted++;
+    }
+    if (compressed)
+        std::cout << converted << " textures, " << raw / 1024 << " KiB -> " << compressed / 1024 << " KiB ("
+                  << std::fixed << std::setprecision(1) << (double)raw / compressed << "x)" << std::endl;
+    return converted;
+}
@@ -0,0 +1,78 @@
+#ifndef COMPRESSED_H
+#define COMPRESSED_H
+
+#include <string>
+#include <vector>
+#include <iosfwd>
+
+#include <GL/glew.h>
+
+#define FOURCC_ATI2 0x32495441 // "ATI2", BC5 before DX10 headers
+#define FOURCC_BC5U 0x55354342 // "BC5U"
+#define FOURCC_DX10 0x30315844 // "DX10", format given as a DXGI_FORMAT
+
+/**!
+ * \short Block compressed image with its whole mip chain, as stored in DDS and KTX files
+ * Supports BC1, BC3, BC5 and BC7 payloads. BC1, BC3 and BC5 can also be
+ * encoded from RGBA pixels, which is what the offline converter uses.
+ */
+class CompressedImage {
+    public:
+        struct Level {
+            int width, height;
+            std::vector<unsigned char> data;
+        };
+
+        GLenum format;
+        std::vector<Level> levels;     // every level of the first face, then of the next one
+        int faces;                      // 6 for cube maps, in +X, -X, +Y, -Y, +Z, -Z order
+
+        CompressedImage(): format(0), levels(), faces(1) {}
+
+        inline int mipCount() const { return levels.size() / faces; }
+
+        static bool isCompressedPath(const std::string& path);
+
+        /**!
+         * \short Read a .dds or .ktx file
+         */
+        static bool load(const std::string& path, CompressedImage& image);
+
+        /**!
+         * \short Read only the GL format and size of the top level out of the file header
+         */
+        static bool readFormat(const std::string& path, GLenum* format, int* width = nullptr, int* height = nullptr);
+
+        bool saveDDS(const std::string& path) const;
+
+        size_t size() const;
+
+        /**!
+         * \short Whether the current context can sample that format, GL thread only
+         */
+        static bool supported(GLenum format);
+
+        static size_t blockBytes(GLenum format);
+        static size_t levelBytes(GLenum format, int width, int height);
+
+        /**!
+         * \short Build the mip chain of RGBA pixels and compress every level
+         * \param format One of the BC1 (DXT1), BC3 (DXT5) or BC5 (RGTC2) formats
+         */
+        static CompressedImage encode(const unsigned char* rgba, int width, int height, GLenum format);
+
+        /**!
+         * \short Write a .dds next to every .png of a directory, normal maps as BC5
+         * \return Number of files converted
+         */
+        static int convertDirectory(const std::string& directory);
+
+    private:
+        static bool _loadDDS(std::ifstream& file, CompressedImage* image, GLenum* format, int* width, int* height);
+        static bool _loadKTX(std::ifstream& file, CompressedImage* image, GLenum* format, int* width, int* height);
+
+        static void _encodeColorBlock(const unsigned char block[16][4], unsigned char* out);
+        static void _encodeAlphaBlock(const unsigned char block[16][4], int channel, unsigned char* out);
+};
+
+#endif
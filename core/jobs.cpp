@@ -0,0 +1,130 @@
+#include "jobs.hpp"
+#include "common.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+std::vector<std::thread> JobSystem::WORKERS;
+std::deque<std::function<void()>> JobSystem::QUEUE;
+std::mutex JobSystem::LOCK;
+std::condition_variable JobSystem::WAKE;
+bool JobSystem::STARTED = false;
+bool JobSystem::STOPPING = false;
+
+// Workers must be joined before the statics above are destroyed
+static struct JobSystemShutdown {
+    ~JobSystemShutdown() { JobSystem::stop(); }
+} JOB_SYSTEM_SHUTDOWN;
+
+void JobSystem::start(unsigned threads){
+    stop();
+
+    std::lock_guard<std::mutex> lock(LOCK);
+    STOPPING = false;
+    STARTED = true;
+    for (unsigned i = 0; i < threads; i++)
+        WORKERS.push_back(std::thread(_worker));
+    DEBUG(Debug::Info, "Job system started with %u workers\n", threads);
+}
+
+void JobSystem::stop(){
+    {
+        std::lock_guard<std::mutex> lock(LOCK);
+        if (!STARTED)
+            return;
+        STOPPING = true;
+    }
+    WAKE.notify_all();
+    for (std::thread& t: WORKERS)
+        t.join();
+
+    std::lock_guard<std::mutex> lock(LOCK);
+    WORKERS.clear();
+    STARTED = false;
+}
+
+void JobSystem::_ensureStarted(){
+    {
+        std::lock_guard<std::mutex> lock(LOCK);
+        if (STARTED)
+            return;
+    }
+    unsigned hardware = std::thread::hardware_concurrency();
+    start(hardware > 1 ? hardware - 1 : 0);
+}
+
+unsigned JobSystem::concurrency(){
+    _ensureStarted();
+    std::lock_guard<std::mutex> lock(LOCK);
+    return WORKERS.size() + 1;
+}
+
+void JobSystem::_worker(){
+    for (;;){
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(LOCK);
+            WAKE.wait(lock, []{ return STOPPING || !QUEUE.empty(); });
+            if (QUEUE.empty())
+                return;
+            job = std::move(QUEUE.front());
+            QUEUE.pop_front();
+        }
+        job();
+    }
+}
+
+void JobSystem::submit(std::function<void()> job){
+    _ensureStarted();
+    {
+        std::lock_guard<std::mutex> lock(LOCK);
+        if (!WORKERS.empty()){
+            QUEUE.push_back(std::move(job));
+            WAKE.notify_one();
+            return;
+        }
+    }
+    job();
+}
+
+void JobSystem::parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)>& body){
+    if (!grain)
+        grain = 1;
+    size_t chunks = (count + grain - 1) / grain;
+    unsigned helpers = std::min<size_t>(concurrency() - 1, chunks ? chunks - 1 : 0);
+
+    if (!helpers){
+        if (count)
+            body(0, count);
+        return;
+    }
+
+    // Shared with the helpers, which may still hold it after we return
+    struct State {
+        std::atomic<size_t> next, done;
+        std::mutex lock;
+        std::condition_variable finished;
+    };
+    std::shared_ptr<State> state(new State);
+    state->next = 0;
+    state->done = 0;
+
+    std::function<void()> run = [state, chunks, count, grain, &body](){
+        size_t c;
+        while ((c = state->next++) < chunks){
+            body(c * grain, std::min(count, (c + 1) * grain));
+            if (++state->done == chunks){
+                std::lock_guard<std::mutex> lock(state->lock);
+                state->finished.notify_all();
+            }
+        }
+    };
+
+    for (unsigned h = 0; h < helpers; h++)
+        submit(run);
+    run();
+
+    std::unique_lock<std::mutex> lock(state->lock);
+    state->finished.wait(lock, [&state, chunks]{ return state->done == chunks; });
+}
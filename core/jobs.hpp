@@ -0,0 +1,49 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/**!
+ * \short Pool of worker threads shared by the CPU heavy tasks
+ * Workers are started on first use, one less than the hardware threads
+ * unless set with \ref start. With no worker every job runs on the caller.
+ */
+class JobSystem {
+    public:
+        static void start(unsigned threads);
+        static void stop();
+
+        /**!
+         * \short Number of threads taking part in a parallelFor, caller included
+         */
+        static unsigned concurrency();
+
+        /**!
+         * \short Run a job on a worker, without waiting for it
+         */
+        static void submit(std::function<void()> job);
+
+        /**!
+         * \short Split [0, count) in chunks of at least grain items and wait for all of them
+         * \param body Called with the [begin, end) range of a chunk, possibly from several threads
+         */
+        static void parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)>& body);
+
+    private:
+        static void _ensureStarted();
+        static void _worker();
+
+        static std::vector<std::thread> WORKERS;
+        static std::deque<std::function<void()>> QUEUE;
+        static std::mutex LOCK;
+        static std::condition_variable WAKE;
+        static bool STARTED;
+        static bool STOPPING;
+};
+
+#endif
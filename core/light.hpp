@@ -27,14 +27,17 @@ class Light {
         inline void type(Type t) { _type = t; }
         inline Type type() const { return _type; }
         
-        void bind(Shader* s){
-            s->use();
-            s->setVec3("light.position", _pos);
-            s->setVec3("light.diffuse", _diffuse);
-            s->setVec3("light.specular", _specular);
-            s->setVec3("light.ambient", _ambient);
-            s->setInt("light.type", (int)_type);
-            s->deuse();
+        void bind(Shader* shader){
+            // Every material variant of the shader needs the light
+            for (Shader* s: shader->variants()){
+                s->use();
+                s->setVec3("light.position", _pos);
+                s->setVec3("light.diffuse", _diffuse);
+                s->setVec3("light.specular", _specular);
+                s->setVec3("light.ambient", _ambient);
+                s->setInt("light.type", (int)_type);
+                s->deuse();
+            }
         }
         
         void draw(glm::mat4 proj, glm::mat4 view);
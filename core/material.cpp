@@ -1,12 +1,23 @@
 #include "material.hpp"
 #include "shader.hpp"
 #include "common.hpp"
+#include "texturearray.hpp"
+#include "texturecache.hpp"
+
+#include <algorithm>
 
 Material::Material(glm::vec3 ambient, glm::vec3 diffuse, glm::vec3 specular, float shininess):
     _ambient(ambient), _diffuse(diffuse), _specular(specular), _shininess(shininess), _textures()
 {
 }
 
+Material::~Material(){
+    for (Texture* t: _textures)
+        TextureCache::release(t);
+    for (const std::pair<TextureArray*, int>& l: _layers)
+        TextureCache::release(l.first);
+}
+
 std::vector<Texture*> Material::loadMaterialTextures(const aiMaterial *mat, aiTextureType type, Texture::Type text_type, std::string parent_dir){
     std::vector<Texture*> textures;
     aiString str;
@@ -14,17 +25,12 @@ std::vector<Texture*> Material::loadMaterialTextures(const aiMaterial *mat, aiTe
     for (unsigned int i = 0; i < mat->GetTextureCount(type); i++){
         mat->GetTexture(type, i, &str);
     
-        Texture* texture;
-        
-        auto it = Texture::LOADED.find(str.C_Str());
-        
-        if(it == Texture::LOADED.end()){   // if texture hasn't been loaded already, load it
-            texture = Texture::fromFile(str.C_Str(), parent_dir);
-            texture->type(text_type);
-            Texture::LOADED.insert(std::pair<std::string, Texture*>(str.C_Str(), texture));  // store it as texture loaded for entire model, to ensure we won't unnecesery load duplicate textures.
+        // Shared with every model using the same file, and counted against the texture budget
+        Texture* texture = TextureCache::acquire(str.C_Str(), parent_dir, text_type);
+        if (!texture){
+            DEBUG(Debug::Error, "Cannot load texture %s\n", str.C_Str());
+            continue;
         }
-        else
-            texture = it->second;
     
         textures.push_back(texture);
     }
@@ -33,52 +39,96 @@ std::vector<Texture*> Material::loadMaterialTextures(const aiMaterial *mat, aiTe
 }
 
 
-void Material::apply(Shader* shader, bool safemode){
+std::string Material::_slot(Texture::Type type){
+    switch (type){
+    case Texture::Diffuse:
+        return "diffuse";
+    case Texture::Specular:
+        return "specular";
+    case Texture::Normal:
+        return "normal";
+    case Texture::Height:
+        return "height";
+    default:
+        return "cube";
+    }
+}
+
+GLuint Material::_unit(Texture::Type type){
+    // An array replaces the texture of its slot, both never share a program
+    return (GLuint)type;
+}
 
-    try {
-        shader->setVec3("material.ambient", _ambient);
-        shader->setVec3("material.diffuse", _diffuse);
-        shader->setVec3("material.specular", _specular);
-        shader->setFloat("material.shininess", _shininess);
+void Material::setLayer(Texture* replaced, TextureArray* array, int layer){
+    _textures.erase(std::remove(_textures.begin(), _textures.end(), replaced), _textures.end());
+    _layers.push_back(std::make_pair(array, layer));
+}
 
-        //init
-        shader->setBool("has_diffuse", false);
-        shader->setBool("has_specular", false);
-        shader->setBool("has_normal", false);
-        shader->setBool("has_height", false);
-    } catch (ShaderException* s){
-        if (!safemode)
-            throw s;
-    }
+std::set<std::string> Material::features() const {
+    std::set<std::string> defines;
     
-    for(unsigned int i = 0; i < _textures.size(); i++){
-        Texture* t = _textures[i];
-        
-        std::string fragment_name;
-        
+    for (Texture* t: _textures){
         switch (t->type()){
         case Texture::Diffuse:
-            fragment_name = "diffuse";
+            defines.insert("HAS_DIFFUSE");
             break;
         case Texture::Specular:
-            fragment_name = "specular";
+            defines.insert("HAS_SPECULAR");
             break;
         case Texture::Normal:
-            fragment_name = "normal";
+            defines.insert("HAS_NORMAL");
             break;
         case Texture::Height:
-            fragment_name = "height";
+            defines.insert("HAS_HEIGHT");
             break;
         case Texture::Cube:
-            fragment_name = "cube";
             break;
         }
+        if (t->type() != Texture::Cube && Texture::bindless())
+            defines.insert("BINDLESS");
+    }
+    
+    // e.g. HAS_DIFFUSE and DIFFUSE_ARRAY, sampling texture_diffuse_array at layer_diffuse
+    for (const std::pair<TextureArray*, int>& l: _layers){
+        std::string slot = _slot(l.first->type());
+        std::transform(slot.begin(), slot.end(), slot.begin(), ::toupper);
+        defines.insert("HAS_" + slot);
+        defines.insert(slot + "_ARRAY");
+    }
+    return defines;
+}
+
+void Material::apply(Shader* shader){
 
-        t->apply(shader->getUniformLocation("texture_" + fragment_name));
-        if(t->type() != Texture::Cube)
-            shader->setBool("has_"+fragment_name, true);
+    // Uniforms the shader does not consume (e.g. the skybox) are silently skipped
+    shader->setVec3("material.ambient", _ambient);
+    shader->setVec3("material.diffuse", _diffuse);
+    shader->setVec3("material.specular", _specular);
+    shader->setFloat("material.shininess", _shininess);
+    
+    // Every slot has its own unit in all programs, so consecutive meshes rebind only what changed
+    bool bindless = Texture::bindless();
+    for(unsigned int i = 0; i < _textures.size(); i++){
+        Texture* t = _textures[i];
+        std::string name = "texture_" + _slot(t->type());
+        if (bindless && t->type() != Texture::Cube)
+            shader->setHandle(name, t->handle());
+        else {
+            t->apply(_unit(t->type()));
+            shader->setSampler(name, _unit(t->type()));
+        }
             
-        Debug::CheckOpenGLError("Material applied");
+        GL_CHECK("Material applied");
+    }
+    
+    // Meshes sharing an array only differ by the layer uniform
+    for (const std::pair<TextureArray*, int>& l: _layers){
+        std::string slot = _slot(l.first->type());
+        l.first->apply(_unit(l.first->type()));
+        shader->setSampler("texture_" + slot + "_array", _unit(l.first->type()));
+        shader->setFloat("layer_" + slot, l.second);
+        
+        GL_CHECK("Material applied");
     }
 }
 
@@ -9,20 +9,38 @@
 #include <assimp/texture.h>
 
 #include <vector>
+#include <set>
+#include <string>
 #include "texture.hpp"
 
 class Shader;
+class TextureArray;
 
 class Material {
     public:
     
         Material(glm::vec3 ambient = glm::vec3(0.f), glm::vec3 diffuse = glm::vec3(0.f), glm::vec3 specular = glm::vec3(0.f), float shininess = 0.f);
         
+        /**!
+         * \short Give our textures and texture arrays back to TextureCache
+         */
+        ~Material();
+        
         inline void setTextures(std::vector<Texture*>& t) { _textures = t; }
         inline void addTexture(Texture* t){ _textures.push_back(t); }
         inline std::vector<Texture*> getTextures() { return _textures; }
+        
+        /**!
+         * \short Sample a layer of a texture array instead of one of our textures
+         */
+        void setLayer(Texture* replaced, TextureArray* array, int layer);
 
-        void apply(Shader* usedShader, bool safemode = false);
+        /**!
+         * \short Preprocessor defines selecting the shader variant for this material textures
+         */
+        std::set<std::string> features() const;
+        
+        void apply(Shader* usedShader);
         
         inline void setAmbient(glm::vec3 a) { _ambient = a;};
         inline void setDiffuse(glm::vec3 d) { _diffuse = d;};
@@ -30,7 +48,11 @@ class Material {
         inline void setShininess(float sh) { _shininess = sh;};
         static std::vector<Texture*> loadMaterialTextures(const aiMaterial *mat, aiTextureType type, Texture::Type text_type, std::string parent_dir);
     private:
+        static std::string _slot(Texture::Type type);
+        static GLuint _unit(Texture::Type type);
+    
         std::vector<Texture*> _textures;
+        std::vector<std::pair<TextureArray*, int>> _layers;
     
         glm::vec3 _ambient;
         glm::vec3 _diffuse;
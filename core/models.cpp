@@ -4,6 +4,8 @@
 #include "texture.hpp"
 #include "shader.hpp"
 #include "material.hpp"
+#include "skinning.hpp"
+#include "profiler.hpp"
 #include <assimp/Importer.hpp>      // C++ importer interface
 #include <assimp/scene.h>           // Output data structure
 #include <assimp/postprocess.h>     // Post processing flags
@@ -16,13 +18,17 @@
 int Bone::LAST_ID = 0;
 GLint Mesh::VA_PRIMITIVE = GL_TRIANGLES;
 
+// Vertices are imported as (x, -z, y), bone matrices are not
+static const glm::mat4 IMPORT_AXIS(glm::vec4(1.f, 0.f, 0.f, 0.f), glm::vec4(0.f, 0.f, 1.f, 0.f),
+                                   glm::vec4(0.f, -1.f, 0.f, 0.f), glm::vec4(0.f, 0.f, 0.f, 1.f));
+
 void Bone::dumpToBuffer(std::vector<int>& vertex_buff, std::vector<float>& weight_buff){    
     int i = 0;
     
     for (std::pair<uint, float> p: _weights){
         
         int offset = 0;
-        for (; weight_buff[p.first * 4 + offset] != 0.0; offset++){}
+        for (; offset < 4 && weight_buff[p.first * 4 + offset] != 0.0; offset++){}
         
         if (offset >= 4)
             continue;
@@ -33,12 +39,13 @@ void Bone::dumpToBuffer(std::vector<int>& vertex_buff, std::vector<float>& weigh
         weight_buff[p.first * 4 + offset] = p.second;
     }
 }
-glm::mat4 Bone::transformation() const {
-    return _node->transformation() * _offset;
+glm::mat4 Bone::transformation(const glm::mat4& meshInverse) const {
+    // Offsets and node transformations are stored transposed
+    return IMPORT_AXIS * meshInverse * _node->globalTransformation() * glm::transpose(_offset) * glm::transpose(IMPORT_AXIS);
 }
 
 VertexArray::VertexArray():
-    _len_points(0), _indice(0)
+    _len_points(0), _indice(0), _radius(0.f)
 {    
     glGenVertexArrays(1, &_vertex_array_id);
                 
@@ -67,6 +74,8 @@ void VertexArray::setVertex(std::vector<GLfloat> vertex)
         (void*)0            // array buffer offset
     );
     _len_points = vertex.size() / 3;
+    for (size_t i = 0; i + 2 < vertex.size(); i += 3)
+        _radius = std::max(_radius, glm::length(glm::vec3(vertex[i], vertex[i + 1], vertex[i + 2])));
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
     glBindVertexArray(0);
@@ -146,17 +155,41 @@ void VertexArray::draw(GLint primitive){
     glBindVertexArray(0);
 }
 
-void VertexArray::setBones(std::vector<Bone*> bones, Shader* s)
+void VertexArray::streamVertex(const std::vector<GLfloat>& vertex)
+{
+    glBindVertexArray(_vertex_array_id);
+    glBindBuffer(GL_ARRAY_BUFFER, _vertexbuffer);
+    // Orphan the previous storage rather than waiting for the draws still using it
+    glBufferData(GL_ARRAY_BUFFER, vertex.size() * sizeof(GLfloat), nullptr, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, vertex.size() * sizeof(GLfloat), &vertex[0]);
+    glVertexAttribPointer(GL_LAYOUT_VERTEXARRAY, 3, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), nullptr);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+}
+
+void VertexArray::streamNormal(const std::vector<GLfloat>& normal)
+{
+    glBindVertexArray(_vertex_array_id);
+    glBindBuffer(GL_ARRAY_BUFFER, _normal);
+    glBufferData(GL_ARRAY_BUFFER, normal.size() * sizeof(GLfloat), nullptr, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, normal.size() * sizeof(GLfloat), &normal[0]);
+    glVertexAttribPointer(GL_LAYOUT_NORMAL, 3, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), nullptr);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+}
+
+void VertexArray::setBones(std::vector<Bone*> bones, Skin* skin)
 {   
     std::vector<GLint> bones_buffer(_len_points * 4, 0);
     std::vector<GLfloat> weight_buffer(_len_points * 4, 0.0);
     
-    s->use();
     int bone_id = 0;
     for (Bone* b: bones){        
         b->id(bone_id++);
         b->dumpToBuffer(bones_buffer, weight_buffer);
     }        
+    if (skin)
+        skin->setInfluences(bones_buffer, weight_buffer);
  
     // Uploading to GPU    
     glBindVertexArray(_vertex_array_id);
@@ -165,7 +198,8 @@ void VertexArray::setBones(std::vector<Bone*> bones, Shader* s)
     glEnableVertexAttribArray(GL_LAYOUT_BONES);
     glBindBuffer(GL_ARRAY_BUFFER, _bones_id);
 	glBufferData(GL_ARRAY_BUFFER, bones_buffer.size() * sizeof(GLint), &bones_buffer[0], GL_STATIC_DRAW);
-    glVertexAttribPointer(GL_LAYOUT_BONES, 4, GL_INT, GL_FALSE, 0, nullptr);
+    // Integer attribute, glVertexAttribPointer would convert the ids to float
+    glVertexAttribIPointer(GL_LAYOUT_BONES, 4, GL_INT, 0, nullptr);
     
     
     glEnableVertexAttribArray(GL_LAYOUT_WEIGHT);
@@ -201,32 +235,84 @@ void VertexArray::setBitangents(std::vector<GLfloat> bitangents) {
     glBindVertexArray(0);
 }
 
-void Mesh::draw(glm::mat4 projection, glm::mat4 view, glm::mat4 model){
-    _shader->use();    
+Mesh::Mesh(Shader* s, VertexArray* va, std::vector<Bone*> bones):
+    _bones(bones), _vao(va), _node(nullptr), _skin(nullptr), _cpu_skinned(false), _palette(bones.size(), glm::mat4(1.f)),
+    _material(nullptr), _shader(s), _variant(s), _skinned(s)
+{
+    if (!_bones.empty())
+        _skinned = _shader->variant({"HAS_BONES"});
+}
 
-    // setup camera geometry parameters
-    _shader->setMat4("projection", projection);
-    _shader->setMat4("view", view);
-    _shader->setMat4("model", model, GL_TRUE);
+void Mesh::setMaterial(Material* m){
+    _material = m;
+    _variant = m ? _shader->variant(m->features()) : _shader;
     
-    // bone world transform matrices need to be passed for skinning
-    for (Bone* b: _bones){
-        _shader->setMat4("gBones[" + std::to_string(b->id()) + "]", b->transformation(), GL_TRUE);
+    _skinned = _variant;
+    if (!_bones.empty()){
+        std::set<std::string> features = m ? m->features() : std::set<std::string>();
+        features.insert("HAS_BONES");
+        _skinned = _shader->variant(features);
     }
+}
+
+void Mesh::_skinning(Shader* shader){
+    PROFILE_SCOPE("Mesh::skinning");
+    
+    // The mesh node is the reference frame of the bind pose
+    glm::mat4 meshInverse = _node ? glm::inverse(_node->globalTransformation()) : glm::mat4(1.f);
+    for (Bone* b: _bones)
+        _palette[b->id()] = b->transformation(meshInverse);
+    
+    if (Skin::MODE == Skin::GPU || !_skin){
+        if (_cpu_skinned){
+            _vao->setVertex(_skin->bindPositions());
+            if (_skin->hasNormals())
+                _vao->setNormal(_skin->bindNormals());
+            _cpu_skinned = false;
+        }
+        shader->setMat4Array("gBones", _palette.size(), &_palette[0]);
+        return;
+    }
+    
+    _skin->apply(_palette);
+    _vao->streamVertex(_skin->skinnedPositions());
+    if (_skin->hasNormals())
+        _vao->streamNormal(_skin->skinnedNormals());
+    _cpu_skinned = true;
+}
+
+void Mesh::draw(glm::mat4 projection, glm::mat4 view, glm::mat4 model){
+    Shader* shader = _bones.empty() || (Skin::MODE == Skin::CPU && _skin) ? _variant : _skinned;
+    shader->use();    
+
+    // setup camera geometry parameters, once per draw rather than once per vertex.
+    // Scene matrices are stored transposed, hence the transpose to match the GL_TRUE upload of model.
+    glm::mat4 world = glm::transpose(model);
+    glm::mat4 modelView = view * world;
+    shader->setMat4("model", model, GL_TRUE);
+    shader->setMat4("modelView", modelView);
+    shader->setMat4("mvp", projection * modelView);
+    shader->setMat3("normalMatrix", glm::mat3(glm::inverse(world)));
+    
+    // bone matrices, either uploaded as gBones or applied on the CPU
+    if (!_bones.empty())
+        _skinning(shader);
 
     if (_material)
-        _material->apply(_shader);
+        _material->apply(shader);
         
     // draw mesh vertex array
     _vao->draw(VA_PRIMITIVE);
+    GL_CHECK("Mesh::draw");
 
     // leave with clean OpenGL state, to make it easier to detect problems
-    _shader->deuse();
+    shader->deuse();
 }
 
 Mesh::~Mesh(){
     for (Bone* b: _bones)
         delete b;
+    delete _skin;
     delete _vao;
 }
 
@@ -353,12 +439,10 @@ void Skybox::draw(glm::mat4 projection, glm::mat4 view, glm::mat4 model){
     _shader->use();    
 
     // setup camera geometry parameters
-    _shader->setMat4("projection", projection);
-    _shader->setMat4("view", view);
-    _shader->setMat4("model", model, GL_TRUE);
+    _shader->setMat4("mvp", projection * view * glm::transpose(model));
 
     if (_material)
-        _material->apply(_shader, true);
+        _material->apply(_shader);
         
     // draw mesh vertex array
     VAO()->draw(VA_PRIMITIVE);
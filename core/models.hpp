@@ -14,6 +14,7 @@
 class Shader;
 class Material;
 class Node;
+class Skin;
 
 #define GL_LAYOUT_VERTEXARRAY 0
 #define GL_LAYOUT_UV 1
@@ -38,7 +39,11 @@ class Bone {
         inline void attach(Node* n) { _node = n; }
         inline Node* node() { return _node; }
         
-        glm::mat4 transformation() const ;
+        /**!
+         * \short Skinning matrix of the bone, in the space of the mesh it deforms
+         * \param meshInverse Inverse global transformation of the node holding the mesh
+         */
+        glm::mat4 transformation(const glm::mat4& meshInverse) const ;
         
         inline void id(uint i) { _boneid = i; }
         inline uint id() const { return _boneid; }
@@ -63,11 +68,25 @@ class VertexArray {
         void setUV(std::vector<GLfloat> uv);
         void setNormal(std::vector<GLfloat> normal);
         void setIndice(std::vector<unsigned short> normal);
-        void setBones(std::vector<Bone*> b, Shader* s);
+        /**!
+         * \short Upload bone ids and weights, also kept in skin for CPU skinning when given
+         */
+        void setBones(std::vector<Bone*> b, Skin* skin = nullptr);
         void setTangents(std::vector<GLfloat> tangents);
         void setBitangents(std::vector<GLfloat> bitangents);
         
+        /**!
+         * \short Replace positions or normals with 4 floats per vertex, in a GL_STREAM_DRAW buffer
+         */
+        void streamVertex(const std::vector<GLfloat>& vertex);
+        void streamNormal(const std::vector<GLfloat>& normal);
+        
         virtual void draw(GLint primitive);    
+        
+        /**!
+         * \short Distance from the origin to the farthest vertex given to setVertex
+         */
+        inline float radius() const { return _radius; }
 
     private:
         GLuint _vertex_array_id;
@@ -75,11 +94,12 @@ class VertexArray {
         GLuint _vertexbuffer, _uvbuffer, _normal, _indice, _bones_id, _weight, _tangent, _bitangent;
         
         int _len_points;
+        float _radius;
 };
 
 class Mesh : public Drawable {
     public:
-        Mesh(Shader* s, VertexArray* va, std::vector<Bone*> bones = std::vector<Bone*>()):_shader(s), _vao(va), _bones(bones), _material(nullptr) {}
+        Mesh(Shader* s, VertexArray* va, std::vector<Bone*> bones = std::vector<Bone*>());
         ~Mesh();
         
         void draw(glm::mat4 projection, glm::mat4 view, glm::mat4 model);
@@ -88,23 +108,42 @@ class Mesh : public Drawable {
             std::cout << "Mesh with " << _bones.size() << " bones." << std::endl;
         }
         
-        inline void setMaterial(Material* m) { _material = m; }  
+        /**!
+         * \short Set the material and select the shader variant matching its textures
+         */
+        void setMaterial(Material* m);
             
         inline VertexArray* VAO() const { return _vao; }    
         inline void setVAO(VertexArray* va) { _vao = va; }   
           
         inline const std::vector<Bone*>& bones() const { return _bones; }  
         
+        /**!
+         * \short Bind pose kept on the CPU, needed by Skin::CPU skinning
+         */
+        inline void setSkin(Skin* skin) { _skin = skin; }
+        
+        inline void node(Node* n) { _node = n; }
+        inline Node* node() const { return _node; }
+        
         static GLint VA_PRIMITIVE; //= GL.GL_TRIANGLES
         
     private:    
+        void _skinning(Shader* shader);
         
         std::vector<Bone*> _bones;
         VertexArray* _vao;
         
+        Node* _node;
+        Skin* _skin;
+        bool _cpu_skinned;                  // vertex buffers hold the last CPU skinned pose
+        std::vector<glm::mat4> _palette;
+        
     protected:
         Material* _material;
         Shader* _shader;
+        Shader* _variant;   // _shader specialized for _material
+        Shader* _skinned;   // _variant with GPU skinning
 };
 
 class Skybox : public Mesh {
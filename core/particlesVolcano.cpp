@@ -8,16 +8,211 @@ using namespace glm;
 
 
 #include "shader.hpp"
+#include "profiler.hpp"
+
+#include <iomanip>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define PARTICLES_SSE
+#include <xmmintrin.h>
+#include <emmintrin.h>
+#endif
+
+// Wind of a step from 24 random bits, in [-10, 10)
+#define WIND_SCALE (20.f / 16777216.f)
+
+ParticleSystem::ParticleSystem(size_t capacity, uint32_t seed):
+    _capacity(capacity),
+    _count(0),
+    _rng(seed ? seed : 1)
+{
+    size_t padded = (capacity + 3) / 4 * 4;
+    for (std::vector<float>* a: {&_x, &_y, &_z, &_vx, &_vy, &_vz, &_life, &_size})
+        a->assign(padded, 0.f);
+    _current.assign(padded * 4, 0.f);
+    _previous.assign(padded * 4, 0.f);
+    _colors.assign(padded * 4, 0);
+    for (int l = 0; l < 4; l++)
+        _lanes[l] = _random();
+}
+
+void ParticleSystem::emit(size_t n){
+    n = std::min(n, _capacity - _count);
+    for (size_t i = _count; i < _count + n; i++){
+        _life[i] = 7.0f; // This particle will live 5 seconds.
+        _x[i] = -20.0f;
+        _y[i] = 0.f;
+        _z[i] = 0.f;
+
+        float spread = 1.5f;
+        glm::vec3 maindir = glm::vec3(0.0f, 10.0f, 0.0f);
+        glm::vec3 randomdir = glm::vec3(
+            (_random()%2000 - 1000.0f)/1000.0f,
+            (_random()%2000 - 1000.0f)/1000.0f,
+            (_random()%2000 - 1000.0f)/1000.0f
+        );
+        glm::vec3 speed = maindir + randomdir*spread;
+        _vx[i] = speed.x;
+        _vy[i] = speed.y;
+        _vz[i] = speed.z;
+
+        _colors[4 * i + 0] = (160)+ _random() % 56;
+        _colors[4 * i + 1] = _random() % 64;
+        _colors[4 * i + 2] = 0;
+        _colors[4 * i + 3] = 128 + (_random() % 128);
+
+        _size[i] = (_random()%1000)/2000.0f + 0.1f;
+    }
+    _count += n;
+}
+
+void ParticleSystem::step(float dt){
+    integrate(dt, 0, _count);
+    _recycle();
+}
+
+void ParticleSystem::integrateScalar(float dt, size_t begin, size_t end){
+    float half = dt * 0.5f, gravity = -9.81f * half, lift = 10.0f * dt;
+    // By groups of four, each particle drawing its wind from the generator of its lane as the SIMD kernel does
+    for (size_t group = begin; group < end; group += 4){
+        for (int l = 0; l < 4; l++){
+            _lanes[l] ^= _lanes[l] << 13;
+            _lanes[l] ^= _lanes[l] >> 17;
+            _lanes[l] ^= _lanes[l] << 5;
+        }
+        for (size_t i = group; i < group + 4; i++){
+            float wind = (float)(int32_t)(_lanes[i - group] >> 8) * WIND_SCALE - 10.f;
+
+            _life[i] -= dt;
+            GLfloat* previous = &_previous[4 * i];
+            previous[0] = _x[i];
+            previous[1] = _y[i];
+            previous[2] = _z[i];
+            previous[3] = _size[i];
+
+            // Simulate simple physics : gravity and a random wind, no collisions
+            _vx[i] += wind * half;
+            _vy[i] += gravity;
+            _x[i] += _vx[i] * dt;
+            _y[i] += _vy[i] * dt;
+            _y[i] += lift;
+            _z[i] += _vz[i] * dt;
+
+            GLfloat* current = &_current[4 * i];
+            current[0] = _x[i];
+            current[1] = _y[i];
+            current[2] = _z[i];
+            current[3] = _size[i];
+        }
+    }
+}
+
+#ifdef PARTICLES_SSE
+void ParticleSystem::integrate(float dt, size_t begin, size_t end){
+    __m128i lanes = _mm_loadu_si128((const __m128i*)_lanes);
+    const __m128 vdt = _mm_set1_ps(dt), half = _mm_set1_ps(dt * 0.5f);
+    const __m128 gravity = _mm_set1_ps(-9.81f * (dt * 0.5f)), lift = _mm_set1_ps(10.0f * dt);
+    const __m128 scale = _mm_set1_ps(WIND_SCALE), ten = _mm_set1_ps(10.f);
+
+    for (size_t i = begin; i < end; i += 4){
+        lanes = _mm_xor_si128(lanes, _mm_slli_epi32(lanes, 13));
+        lanes = _mm_xor_si128(lanes, _mm_srli_epi32(lanes, 17));
+        lanes = _mm_xor_si128(lanes, _mm_slli_epi32(lanes, 5));
+        __m128 wind = _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(lanes, 8)), scale), ten);
+
+        _mm_storeu_ps(&_life[i], _mm_sub_ps(_mm_loadu_ps(&_life[i]), vdt));
+
+        __m128 x = _mm_loadu_ps(&_x[i]), y = _mm_loadu_ps(&_y[i]), z = _mm_loadu_ps(&_z[i]), size = _mm_loadu_ps(&_size[i]);
+        __m128 a = x, b = y, c = z, d = size;
+        _MM_TRANSPOSE4_PS(a, b, c, d);
+        _mm_storeu_ps(&_previous[4 * i], a);
+        _mm_storeu_ps(&_previous[4 * i + 4], b);
+        _mm_storeu_ps(&_previous[4 * i + 8], c);
+        _mm_storeu_ps(&_previous[4 * i + 12], d);
+
+        __m128 vx = _mm_add_ps(_mm_loadu_ps(&_vx[i]), _mm_mul_ps(wind, half));
+        __m128 vy = _mm_add_ps(_mm_loadu_ps(&_vy[i]), gravity);
+        __m128 vz = _mm_loadu_ps(&_vz[i]);
+        x = _mm_add_ps(x, _mm_mul_ps(vx, vdt));
+        y = _mm_add_ps(_mm_add_ps(y, _mm_mul_ps(vy, vdt)), lift);
+        z = _mm_add_ps(z, _mm_mul_ps(vz, vdt));
+        _mm_storeu_ps(&_vx[i], vx);
+        _mm_storeu_ps(&_vy[i], vy);
+        _mm_storeu_ps(&_x[i], x);
+        _mm_storeu_ps(&_y[i], y);
+        _mm_storeu_ps(&_z[i], z);
+
+        _MM_TRANSPOSE4_PS(x, y, z, size);
+        _mm_storeu_ps(&_current[4 * i], x);
+        _mm_storeu_ps(&_current[4 * i + 4], y);
+        _mm_storeu_ps(&_current[4 * i + 8], z);
+        _mm_storeu_ps(&_current[4 * i + 12], size);
+    }
+    _mm_storeu_si128((__m128i*)_lanes, lanes);
+}
+#else
+void ParticleSystem::integrate(float dt, size_t begin, size_t end){
+    integrateScalar(dt, begin, end);
+}
+#endif
+
+void ParticleSystem::_recycle(){
+    for (size_t i = 0; i < _count;){
+        if (_life[i] > 0.f){
+            i++;
+            continue;
+        }
+        // Slot i gets the last particle, looked at next
+        _count--;
+        if (i != _count)
+            _move(_count, i);
+    }
+}
+
+void ParticleSystem::_move(size_t from, size_t to){
+    for (std::vector<float>* a: {&_x, &_y, &_z, &_vx, &_vy, &_vz, &_life, &_size})
+        (*a)[to] = (*a)[from];
+    std::copy(&_current[4 * from], &_current[4 * from + 4], &_current[4 * to]);
+    std::copy(&_previous[4 * from], &_previous[4 * from + 4], &_previous[4 * to]);
+    std::copy(&_colors[4 * from], &_colors[4 * from + 4], &_colors[4 * to]);
+}
+
+void ParticleSystem::benchmark(int runs){
+    float dt = 1.f / 60.f;
+    std::cout << "Particles, " << runs << " steps of " << dt << " s (particles/ms):" << std::endl;
+    for (size_t count: {10000, 100000, 1000000}){
+        ParticleSystem particles(count, 1);
+        particles.emit(count);
+
+        double start = Profiler::now();
+        for (int i = 0; i < runs; i++)
+            particles.integrateScalar(dt, 0, count);
+        double scalar = Profiler::now() - start;
+
+        start = Profiler::now();
+        for (int i = 0; i < runs; i++)
+            particles.integrate(dt, 0, count);
+        double simd = Profiler::now() - start;
+
+        double moved = (double)count * runs;
+        std::cout << std::setw(12) << count << std::setw(16) << "scalar" << std::setw(14) << std::fixed << std::setprecision(0) << moved / scalar << std::endl;
+#ifdef PARTICLES_SSE
+        std::cout << std::setw(12) << count << std::setw(16) << "SSE" << std::setw(14) << moved / simd << std::endl;
+#endif
+    }
+}
 
 // CPU representation of a particle
 int ParticuleManager::MAX_PARTICLES = 10000;
+float ParticuleManager::BLEND = 1.f;
+float ParticuleManager::EMISSION_RATE = 1000.f;
+unsigned ParticuleManager::SEED = 2463534242u;
+std::vector<ParticuleManager*> ParticuleManager::INSTANCES;
 
 ParticuleManager::ParticuleManager(Shader* s):
     Mesh(s, nullptr),
-    _last_time(0),
-    _particles_container(),
-    _position_size_data(new GLfloat[MAX_PARTICLES * 4]),
-    _color_data(new GLubyte[MAX_PARTICLES * 4]),
+    _particles(MAX_PARTICLES, SEED),
+    _emission(0.f),
     _vertex_buffer_data(new GLfloat[12]{
 		 -0.5f, -0.5f, 0.0f,
 		  0.5f, -0.5f, 0.0f,
@@ -25,16 +220,6 @@ ParticuleManager::ParticuleManager(Shader* s):
 		  0.5f,  0.5f, 0.0f,
 	})
 {
-    _particles_container.reserve(MAX_PARTICLES);
-	for(int i = 0; i < MAX_PARTICLES; i++){
-		Particle p;
-        p.life = -2.0f;
-		p.cameradistance = -3.0f;        
-        _particles_container.push_back(std::move(p));
-	}
-    
-    _shader->use();
-    
     glGenVertexArrays(1, &_vertex_array_id);
     
     glBindVertexArray(_vertex_array_id);    
@@ -43,11 +228,14 @@ ParticuleManager::ParticuleManager(Shader* s):
 	glBindBuffer(GL_ARRAY_BUFFER, _vertex_buffer);
 	glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 12, _vertex_buffer_data, GL_STATIC_DRAW);
 
-	// The VBO containing the positions and sizes of the particles
+	// The VBOs containing the positions and sizes of the particles, after and before the last step
 	glGenBuffers(1, &_position_buffer);
 	glBindBuffer(GL_ARRAY_BUFFER, _position_buffer);
 	// Initialize with empty (nullptr) buffer : it will be updated later, each frame.
 	glBufferData(GL_ARRAY_BUFFER, MAX_PARTICLES * 4 * sizeof(GLfloat), nullptr, GL_STREAM_DRAW);
+	glGenBuffers(1, &_previous_buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, _previous_buffer);
+	glBufferData(GL_ARRAY_BUFFER, MAX_PARTICLES * 4 * sizeof(GLfloat), nullptr, GL_STREAM_DRAW);
 
 	// The VBO containing the colors of the particles
 	glGenBuffers(1, &_color_buffer);
@@ -55,109 +243,38 @@ ParticuleManager::ParticuleManager(Shader* s):
 	// Initialize with empty (nullptr) buffer : it will be updated later, each frame.
 	glBufferData(GL_ARRAY_BUFFER, MAX_PARTICLES * 4 * sizeof(GLubyte), nullptr, GL_STREAM_DRAW);
     glBindVertexArray(0); 
-
-    // Use our shader
-    _shader->deuse();
     
+    INSTANCES.push_back(this);
 }
 
-int ParticuleManager::update(glm::mat4& view){
-    double currentTime = glfwGetTime();
-    double delta = currentTime - _last_time;
-    _last_time = currentTime;
-
-    // Generate 10 new particule each millisecond,
-    // but limit this to 16 ms (60 fps), or if you have 1 long frame (1sec),
-    // newparticles will be huge and the next frame even longer.
-    int newparticles = (int)(delta*1000.0);
-    if (newparticles > (int)(0.016f*1000.0))
-        newparticles = (int)(0.016f*1000.0);
-        
-    if (MAX_PARTICLES - _particles_container.size() < newparticles)
-        newparticles = MAX_PARTICLES - _particles_container.size();
-        
-        
-    for (auto particule = _particles_container.begin(); particule != _particles_container.end();){
-        if (particule->life < 0)
-            particule = _particles_container.erase(particule);
-        else
-            ++particule;
-    }
-
-    for(int i=0; i<newparticles; i++){
-        Particle p;
-        p.life = 7.0f; // This particle will live 5 seconds.
-        p.pos = glm::vec3(-20.0f,0,0);
-
-        float spread = 1.5f;
-        glm::vec3 maindir = glm::vec3(0.0f, 10.0f, 0.0f);
-        glm::vec3 randomdir = glm::vec3(
-            (rand()%2000 - 1000.0f)/1000.0f,
-            (rand()%2000 - 1000.0f)/1000.0f,
-            (rand()%2000 - 1000.0f)/1000.0f
-        );
-
-        p.speed = maindir + randomdir*spread;
-
-        p.r = (160)+ rand() % 56;
-        p.g = rand() % 64;
-        p.b = 0;
-        p.a = 128 + (rand() % 128);
+void ParticuleManager::updateAll(float dt){
+    for (ParticuleManager* pm: INSTANCES)
+        pm->update(dt);
+}
 
-        p.size = (rand()%1000)/2000.0f + 0.1f;
-        _particles_container.push_back(std::move(p));
-    }
+void ParticuleManager::update(float dt){
+    PROFILE_SCOPE("ParticuleManager::update");
 
-    // Simulate all particles
-    int nb_particles = 0;
-    glm::vec3 CameraPosition(glm::inverse(view)[3].x, glm::inverse(view)[3].y, glm::inverse(view)[3].z);
-    for (auto particule = _particles_container.begin(); particule != _particles_container.end(); ++particule){
-        Particle& p = *particule;
-        
-        if(p.life > 0.0f){
-
-            // Decrease life
-            p.life -= delta;
-            if (p.life > 0.0f){
-
-                // Simulate simple physics : gravity only, no collisions
-                float x=(rand() % 20)-10;
-                p.speed += glm::vec3(x,-9.81f, 0) * (float)delta * 0.5f;
-                p.pos += p.speed * (float)delta;
-                p.cameradistance = glm::length2( p.pos - CameraPosition );
-                p.pos += glm::vec3(0.0f,10.0f, 0.0f) * (float)delta;
-
-                // Fill the GPU buffer
-                _position_size_data[4 * nb_particles + 0] = p.pos.x;
-                _position_size_data[4 * nb_particles + 1] = p.pos.y;
-                _position_size_data[4 * nb_particles + 2] = p.pos.z;
-
-                _position_size_data[4 * nb_particles + 3] = p.size;
-
-                _color_data[4 * nb_particles + 0] = p.r;
-                _color_data[4 * nb_particles + 1] = p.g;
-                _color_data[4 * nb_particles + 2] = p.b;
-                _color_data[4 * nb_particles + 3] = p.a;
-                nb_particles++;
-
-            } else{
-                // Particles that just died will be put at the end of the buffer in SortParticles();
-                p.cameradistance = -5.0f;
-            }
-        }
-    }
-    return nb_particles;
+    // Generate a new particule each millisecond, the fraction left is carried to the next step
+    // so that the rate holds whatever the step; those finding the pool full are lost.
+    _emission += dt * EMISSION_RATE;
+    int newparticles = (int)_emission;
+    _emission -= newparticles;
+    
+    _particles.emit(newparticles);
+    _particles.step(dt);
 }
 
 void ParticuleManager::draw(glm::mat4 projection, glm::mat4 view, glm::mat4 model){
+    PROFILE_GPU_SCOPE("Particles");
     _shader->use();
-    int nb_particles = update(view);
+    
+    int nb_particles = _particles.size();
     
     _shader->setVec3("CameraRight_worldspace", view[0][0], view[1][0], view[2][0]);
     _shader->setVec3("CameraUp_worldspace", view[0][1], view[1][1], view[2][1]);
-    _shader->setMat4("P", projection);
-    _shader->setMat4("V", view);
-    _shader->setMat4("M", model, GL_TRUE);
+    _shader->setMat4("MVP", projection * view * glm::transpose(model));
+    _shader->setFloat("blend", BLEND);
     
     glBindVertexArray(_vertex_array_id);
 
@@ -171,38 +288,46 @@ void ParticuleManager::draw(glm::mat4 projection, glm::mat4 view, glm::mat4 mode
     glEnableVertexAttribArray(1);
     glBindBuffer(GL_ARRAY_BUFFER, _position_buffer);
     glBufferData(GL_ARRAY_BUFFER, MAX_PARTICLES * 4 * sizeof(GLfloat), NULL, GL_STREAM_DRAW); // Buffer orphaning, a common way to improve streaming perf. See above link for details.
-    glBufferSubData(GL_ARRAY_BUFFER, 0, nb_particles * sizeof(GLfloat) * 4, _position_size_data);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, nb_particles * sizeof(GLfloat) * 4, _particles.positions());
     glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 0, (void*)0);
 
+    glEnableVertexAttribArray(3);
+    glBindBuffer(GL_ARRAY_BUFFER, _previous_buffer);
+    glBufferData(GL_ARRAY_BUFFER, MAX_PARTICLES * 4 * sizeof(GLfloat), NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, nb_particles * sizeof(GLfloat) * 4, _particles.previousPositions());
+    glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, 0, (void*)0);
+
     glEnableVertexAttribArray(2);
     glBindBuffer(GL_ARRAY_BUFFER, _color_buffer);
     glBufferData(GL_ARRAY_BUFFER, MAX_PARTICLES * 4 * sizeof(GLubyte), NULL, GL_STREAM_DRAW); // Buffer orphaning, a common way to improve streaming perf. See above link for details.
-    glBufferSubData(GL_ARRAY_BUFFER, 0, nb_particles * sizeof(GLubyte) * 4, _color_data);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, nb_particles * sizeof(GLubyte) * 4, _particles.colors());
     glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, 0, (void*)0);
 
     glVertexAttribDivisor(0, 0); // particles vertices : always reuse the same 4 vertices -> 0
     glVertexAttribDivisor(1, 1); // positions : one per quad (its center)                 -> 1
     glVertexAttribDivisor(2, 1); // color : one per quad   
+    glVertexAttribDivisor(3, 1); // previous positions : one per quad
     
     glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, nb_particles); 
     glDisableVertexAttribArray(0);
     glDisableVertexAttribArray(1);
     glDisableVertexAttribArray(2);
+    glDisableVertexAttribArray(3);
     glBindVertexArray(0);   
     _shader->deuse();
     
 }
 
 ParticuleManager::~ParticuleManager(){
+    INSTANCES.erase(std::remove(INSTANCES.begin(), INSTANCES.end(), this), INSTANCES.end());
     
 	glDeleteBuffers(1, &_color_buffer);
 	glDeleteBuffers(1, &_position_buffer);
+	glDeleteBuffers(1, &_previous_buffer);
 	glDeleteBuffers(1, &_vertex_buffer);
     
 	glDeleteVertexArrays(1, &_vertex_array_id);
     
     delete _shader;
     delete _vertex_buffer_data;
-    delete _position_size_data;
-    delete _color_data;
 }
@@ -1,10 +1,10 @@
-
 #ifndef PARTICULES_H
 #define PARTICULES_H
 
 #include <vector>
 #include <algorithm>
 #include <iostream>
+#include <cstdint>
 
 #include <GL/glew.h>
 
@@ -15,47 +15,114 @@
 
 class Shader;
 
-struct Particle {
-	glm::vec3 pos, speed;
-	unsigned char r,g,b,a; // Color
-	float size, angle, weight;
-	float life; // Remaining life of the particle. if <0 : dead and unused.
-	float cameradistance; // *Squared* distance to the camera. if dead : -1.0f
-
-	bool operator<(const Particle& that) const {
-		// Sort in reverse order : far particles drawn first.
-		return this->cameradistance > that.cameradistance;
-	}
+/**!
+ * \short Volcano particles, one array per attribute, moved four at a time with SSE
+ * Positions and sizes are also kept as the xyzs quadruplets the vertex shader
+ * reads, before and after the last step, and colors as its RGBA bytes: the
+ * kernel writes these streams while integrating, so that drawing only
+ * uploads them. Storage is allocated once for the capacity, padded to a
+ * multiple of four particles; live particles are the first \ref size ones,
+ * a dying particle taking the place of the last one.
+ */
+class ParticleSystem {
+    public:
+        ParticleSystem(size_t capacity, uint32_t seed);
+
+        /**!
+         * \short Spawn up to n particles at the mouth of the volcano, as many as the capacity leaves room for
+         */
+        void emit(size_t n);
+
+        /**!
+         * \short Move every particle by dt seconds, then drop those whose life ran out
+         */
+        void step(float dt);
+
+        /**!
+         * \short Integrate the particles [begin, end), begin a multiple of 4, with SSE when available
+         */
+        void integrate(float dt, size_t begin, size_t end);
+        void integrateScalar(float dt, size_t begin, size_t end);
+
+        inline size_t size() const { return _count; }
+        inline size_t capacity() const { return _capacity; }
+
+        inline const GLfloat* positions() const { return &_current[0]; }    // xyzs per particle
+        inline const GLfloat* previousPositions() const { return &_previous[0]; }
+        inline const GLubyte* colors() const { return &_colors[0]; }        // RGBA per particle
+
+        /**!
+         * \short Print particles moved per millisecond by the scalar and SIMD kernels for 10k, 100k and 1M particles
+         */
+        static void benchmark(int runs = 20);
+
+    private:
+        /**!
+         * \short xorshift32, the same sequence on every platform and run
+         */
+        inline uint32_t _random(){
+            _rng ^= _rng << 13;
+            _rng ^= _rng >> 17;
+            _rng ^= _rng << 5;
+            return _rng;
+        }
+
+        /**!
+         * \short Drop the particles whose life ran out, moving the last live ones into their slots
+         */
+        void _recycle();
+        
+        /**!
+         * \short Copy particle from into slot to, in every array and stream
+         */
+        void _move(size_t from, size_t to);
+
+        size_t _capacity, _count;
+        uint32_t _rng;
+        uint32_t _lanes[4];     // one xorshift32 per SIMD lane, for the wind of each step
+
+        std::vector<float> _x, _y, _z, _vx, _vy, _vz, _life, _size;
+        std::vector<GLfloat> _current, _previous;
+        std::vector<GLubyte> _colors;
 };
 
 class ParticuleManager : public Mesh {
     public:
         ParticuleManager(Shader*);
         ~ParticuleManager();
-        int update(glm::mat4& view);
+
+        /**!
+         * \short Emit and move the particles by one simulation step of dt seconds
+         */
+        void update(float dt);
         virtual void draw(glm::mat4 projection, glm::mat4 view, glm::mat4 model);
-        
+
+        /**!
+         * \short Step every particle system, see Scene::advance
+         */
+        static void updateAll(float dt);
+
+        static float BLEND;         // fraction of the way from the previous step to the last one drawn
+        static float EMISSION_RATE; // particles per second
+        static unsigned SEED;       // of the generator of each new particle system
+
         void dump(int level){
             std::cout << "Particule engine." << std::endl;
         }
-        
-        inline int findUnusedParticle(){
-            return (_particles_container.size() < MAX_PARTICLES ? _particles_container.size() : 0); // All particles are taken, override the first one
-        }
-    private:    
+    private:
         static int MAX_PARTICLES;
-        
-        double _last_time;
-        std::vector<Particle> _particles_container;	
-        
+        static std::vector<ParticuleManager*> INSTANCES;
+
+        ParticleSystem _particles;
+        float _emission;            // particles due but not emitted yet, less than one
+
         GLuint _vertex_array_id;
-    
+
         GLuint _vertex_buffer;
         GLuint _position_buffer;
+        GLuint _previous_buffer;
         GLuint _color_buffer;
-        
+
         GLfloat* _vertex_buffer_data;
-        GLfloat* _position_size_data;
-        GLubyte* _color_data;
 };
 #endif
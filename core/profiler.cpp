@@ -0,0 +1,206 @@
+#include "profiler.hpp"
+#include "common.hpp"
+
+#include <chrono>
+#include <fstream>
+#include <algorithm>
+
+bool Profiler::ENABLED = false;
+unsigned Profiler::FRAME = 0;
+
+std::vector<Profiler::Event> Profiler::STACK;
+std::vector<Profiler::GpuPending> Profiler::GPU_STACK;
+std::vector<Profiler::GpuPending> Profiler::GPU_PENDING;
+std::vector<GLuint> Profiler::QUERY_POOL;
+
+std::vector<Profiler::Event> Profiler::CAPTURED;
+std::map<std::string, Profiler::Stat> Profiler::STATS;
+unsigned Profiler::STAT_FRAMES = 0;
+
+std::string Profiler::CAPTURE_PATH;
+unsigned Profiler::CAPTURE_FIRST = 0;
+unsigned Profiler::CAPTURE_COUNT = 0;
+
+double Profiler::GPU_BASE_CPU = 0.;
+GLint64 Profiler::GPU_BASE = 0;
+
+// Number of frames a GPU query is given before its result is read back
+#define GPU_QUERY_LATENCY 3
+
+static std::chrono::steady_clock::time_point PROFILER_EPOCH = std::chrono::steady_clock::now();
+
+double Profiler::now(){
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - PROFILER_EPOCH).count();
+}
+
+void Profiler::enable(bool e){
+    ENABLED = e;
+}
+
+void Profiler::capture(std::string path, unsigned first, unsigned count){
+    CAPTURE_PATH = path;
+    CAPTURE_FIRST = first;
+    CAPTURE_COUNT = count;
+    CAPTURED.clear();
+    enable();
+}
+
+void Profiler::beginFrame(){
+    if (!ENABLED)
+        return;
+
+    // Align the GPU clock on the CPU one the first time we have a context
+    if (!GPU_BASE){
+        glGetInteger64v(GL_TIMESTAMP, &GPU_BASE);
+        GPU_BASE_CPU = now();
+    }
+
+    push("Frame");
+}
+
+void Profiler::endFrame(){
+    if (!ENABLED)
+        return;
+
+    pop();
+    _resolveGpu(false);
+    STAT_FRAMES++;
+
+    if (CAPTURE_COUNT && FRAME + 1 == CAPTURE_FIRST + CAPTURE_COUNT){
+        _resolveGpu(true);
+        if (writeTrace(CAPTURE_PATH))
+            DEBUG(Debug::Info, "\nProfiler: %d frames written to %s\n", CAPTURE_COUNT, CAPTURE_PATH.c_str());
+        CAPTURE_COUNT = 0;
+        CAPTURED.clear();
+    }
+    FRAME++;
+}
+
+void Profiler::push(const char* name){
+    Event e;
+    e.name = name;
+    e.start = now();
+    e.duration = 0.;
+    e.depth = STACK.size();
+    e.frame = FRAME;
+    e.gpu = false;
+    STACK.push_back(e);
+}
+
+void Profiler::pop(){
+    if (STACK.empty())
+        return;
+    Event e = STACK.back();
+    STACK.pop_back();
+    e.duration = now() - e.start;
+    _record(e);
+}
+
+GLuint Profiler::_query(){
+    if (QUERY_POOL.empty()){
+        GLuint q;
+        glGenQueries(1, &q);
+        return q;
+    }
+    GLuint q = QUERY_POOL.back();
+    QUERY_POOL.pop_back();
+    return q;
+}
+
+void Profiler::pushGpu(const char* name){
+    // Timestamps rather than GL_TIME_ELAPSED so that GPU scopes may nest
+    GpuPending p;
+    p.name = name;
+    p.depth = GPU_STACK.size();
+    p.frame = FRAME;
+    p.queries[0] = _query();
+    p.queries[1] = 0;
+    glQueryCounter(p.queries[0], GL_TIMESTAMP);
+    GPU_STACK.push_back(p);
+}
+
+void Profiler::popGpu(){
+    if (GPU_STACK.empty())
+        return;
+    GpuPending p = GPU_STACK.back();
+    GPU_STACK.pop_back();
+    p.queries[1] = _query();
+    glQueryCounter(p.queries[1], GL_TIMESTAMP);
+    GPU_PENDING.push_back(p);
+}
+
+void Profiler::_resolveGpu(bool wait){
+    std::vector<GpuPending> remaining;
+    for (GpuPending& p: GPU_PENDING){
+        if (!wait && p.frame + GPU_QUERY_LATENCY > FRAME){
+            remaining.push_back(p);
+            continue;
+        }
+
+        GLint available = GL_TRUE;
+        if (!wait)
+            glGetQueryObjectiv(p.queries[1], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available){
+            remaining.push_back(p);
+            continue;
+        }
+
+        GLuint64 begin, end;
+        glGetQueryObjectui64v(p.queries[0], GL_QUERY_RESULT, &begin);
+        glGetQueryObjectui64v(p.queries[1], GL_QUERY_RESULT, &end);
+
+        Event e;
+        e.name = p.name;
+        e.start = GPU_BASE_CPU + (double)((GLint64)begin - GPU_BASE) / 1000.;
+        e.duration = (double)(end - begin) / 1000.;
+        e.depth = p.depth;
+        e.frame = p.frame;
+        e.gpu = true;
+        _record(e);
+
+        QUERY_POOL.push_back(p.queries[0]);
+        QUERY_POOL.push_back(p.queries[1]);
+    }
+    GPU_PENDING.swap(remaining);
+}
+
+void Profiler::_record(const Event& e){
+    Stat& s = STATS[std::string(e.gpu ? "GPU " : "") + e.name];
+    s.total += e.duration;
+    s.calls++;
+
+    if (CAPTURE_COUNT && e.frame >= CAPTURE_FIRST && e.frame < CAPTURE_FIRST + CAPTURE_COUNT)
+        CAPTURED.push_back(e);
+}
+
+void Profiler::report(){
+    if (!STAT_FRAMES)
+        return;
+
+    std::cout << std::endl << "Profile over " << STAT_FRAMES << " frames (ms/frame, calls/frame):" << std::endl;
+    for (auto s: STATS)
+        std::cout << std::setw(28) << s.first << std::setw(10) << std::fixed << std::setprecision(3)
+                  << s.second.total / 1000. / STAT_FRAMES << std::setw(10) << std::setprecision(1)
+                  << (double)s.second.calls / STAT_FRAMES << std::endl;
+}
+
+bool Profiler::writeTrace(std::string path){
+    std::ofstream out(path);
+    if (!out.is_open()){
+        DEBUG(Debug::Error, "Profiler: cannot open %s\n", path.c_str());
+        return false;
+    }
+
+    std::sort(CAPTURED.begin(), CAPTURED.end(), [](const Event& a, const Event& b){ return a.start < b.start; });
+
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" << std::endl;
+    out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"CPU\"}}," << std::endl;
+    out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"GPU\"}}";
+    out << std::fixed << std::setprecision(3);
+    for (const Event& e: CAPTURED){
+        out << "," << std::endl << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << (e.gpu ? 2 : 1)
+            << ",\"ts\":" << e.start << ",\"dur\":" << e.duration << ",\"args\":{\"frame\":" << e.frame << "}}";
+    }
+    out << std::endl << "]}" << std::endl;
+    return true;
+}
@@ -0,0 +1,114 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include <GL/glew.h>
+
+/**!
+ * \short Hierarchical frame profiler
+ * CPU scopes are timed with a monotonic clock, GPU scopes with GL timestamp
+ * queries resolved a few frames later. Nothing is recorded while disabled,
+ * and the PROFILE_* macros vanish entirely when built with -DNO_PROFILER.
+ */
+class Profiler {
+    public:
+        struct Event {
+            const char* name;
+            double start;       // microseconds since program start, see Profiler::now
+            double duration;    // microseconds
+            int depth;
+            unsigned frame;
+            bool gpu;
+        };
+
+        static void enable(bool e = true);
+        static inline bool enabled() { return ENABLED; }
+
+        /**!
+         * \short Record the frames [first, first + count) and write them as a Chrome trace
+         * \param path Output JSON file, loadable in chrome://tracing or Perfetto
+         */
+        static void capture(std::string path, unsigned first, unsigned count);
+
+        static void beginFrame();
+        static void endFrame();
+
+        static double now();
+
+        static void push(const char* name);
+        static void pop();
+
+        static void pushGpu(const char* name);
+        static void popGpu();
+
+        static void report();
+        static bool writeTrace(std::string path);
+
+        static inline unsigned frame() { return FRAME; }
+
+    private:
+        struct GpuPending {
+            const char* name;
+            GLuint queries[2];
+            int depth;
+            unsigned frame;
+        };
+        struct Stat {
+            double total;
+            unsigned calls;
+        };
+
+        static void _record(const Event& e);
+        static void _resolveGpu(bool wait);
+        static GLuint _query();
+
+        static bool ENABLED;
+        static unsigned FRAME;
+
+        static std::vector<Event> STACK;
+        static std::vector<GpuPending> GPU_STACK;
+        static std::vector<GpuPending> GPU_PENDING;
+        static std::vector<GLuint> QUERY_POOL;
+
+        static std::vector<Event> CAPTURED;
+        static std::map<std::string, Stat> STATS;
+        static unsigned STAT_FRAMES;
+
+        static std::string CAPTURE_PATH;
+        static unsigned CAPTURE_FIRST, CAPTURE_COUNT;
+
+        static double GPU_BASE_CPU;
+        static GLint64 GPU_BASE;
+};
+
+class ProfileScope {
+    public:
+        ProfileScope(const char* name): _active(Profiler::enabled()) { if (_active) Profiler::push(name); }
+        ~ProfileScope() { if (_active) Profiler::pop(); }
+    private:
+        bool _active;
+};
+
+class GpuProfileScope {
+    public:
+        GpuProfileScope(const char* name): _active(Profiler::enabled()) { if (_active) Profiler::pushGpu(name); }
+        ~GpuProfileScope() { if (_active) Profiler::popGpu(); }
+    private:
+        bool _active;
+};
+
+#define PROFILE_CONCAT_(a, b) a ## b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+
+#ifdef NO_PROFILER
+#define PROFILE_SCOPE(name)
+#define PROFILE_GPU_SCOPE(name)
+#else
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(_profile_scope_, __LINE__)(name)
+#define PROFILE_GPU_SCOPE(name) GpuProfileScope PROFILE_CONCAT(_gpu_profile_scope_, __LINE__)(name)
+#endif
+
+#endif
@@ -7,12 +7,18 @@
 #include "material.hpp"
 #include "animations.hpp"
 #include "camera.hpp"
+#include "profiler.hpp"
+#include "skinning.hpp"
+#include "particlesVolcano.h"
 
 #include <map>
 #include <iostream>
 #include <iomanip>
 
 
+float Scene::STEP = 1.f / 60.f;
+int Scene::MAX_STEPS = 5;
+
 Scene::Scene():
     _models(),
     _textures(),
@@ -22,6 +28,10 @@ Scene::Scene():
     _shaders(),
     _animations(),
     _current_animation(),
+    _baked(),
+    _instances(),
+    _time(0.),
+    _accumulator(0.),
     _skybox(nullptr)
 {
 }
@@ -125,8 +135,8 @@ Scene* Scene::import(std::string path, Shader* shader){
         }
 
         // Fill vertices normals
+        std::vector<GLfloat> normals;
         if (mesh->HasNormals()){
-            std::vector<GLfloat> normals;
             normals.reserve(mesh->mNumVertices * 3);
             for(unsigned int i=0; i<mesh->mNumVertices; i++){
                 aiVector3D n = mesh->mNormals[i];
@@ -196,9 +206,12 @@ Scene* Scene::import(std::string path, Shader* shader){
                 bones.push_back(b);
             }
         }
-        v->setBones(bones, shader);
+        // Bind pose kept for CPU skinning
+        Skin* skin = bones.empty() ? nullptr : new Skin(vertices, normals);
+        v->setBones(bones, skin);
         
         Mesh* _m = new Mesh(shader, v, bones);
+        _m->setSkin(skin);
         if(mesh->mMaterialIndex >= 0)
             _m->setMaterial(materials[mesh->mMaterialIndex]);
         s->addMesh(_m);
@@ -265,14 +278,16 @@ Scene* Scene::import(std::string path, Shader* shader){
             Channel* c = new Channel(relatedNode, relatedBones);
                                    
             for (int j = 0; j < channel->mNumPositionKeys; j++)                    
-                c->addKey(channel->mPositionKeys[j].mTime, new PositionKey(aiVector3DtoglmVec3(channel->mPositionKeys[j].mValue)));
+                c->addPositionKey(channel->mPositionKeys[j].mTime, aiVector3DtoglmVec3(channel->mPositionKeys[j].mValue));
 
             for (int j = 0; j < channel->mNumRotationKeys; j++){             
-                c->addKey(channel->mRotationKeys[j].mTime, new RotationKey(aiQuattoglmQuat(channel->mRotationKeys[j].mValue)));  
+                c->addRotationKey(channel->mRotationKeys[j].mTime, aiQuattoglmQuat(channel->mRotationKeys[j].mValue));  
             }
                         
             anim->addChannel(c);
         }
+        if (Animation::COMPRESSION_TOLERANCE > 0.f)
+            anim->compress(Animation::COMPRESSION_TOLERANCE);
         animations.push_back(anim);            
     }
     s->setAnimations(animations);
@@ -286,17 +301,22 @@ void Scene::render(){
     if (!_active_camera)
         throw new SceneException("No camera selected for rendering.");
 
-    if(_light) {
-        _light->setPos(glm::vec3(fmod(glfwGetTime(),20), 10.0, 1.0));
-        _light->bind(defaultShader());
-    }
-
     //Draw skybox
-    if(_skybox)       
+    if(_skybox){
+        PROFILE_SCOPE("Skybox::draw");
+        PROFILE_GPU_SCOPE("Skybox");
         _skybox->draw(_active_camera->projectionMatrix(), _active_camera->viewMatrix(), glm::rotate(glm::mat4(1.f), glm::radians(-90.f), glm::vec3(1.0f, 0.0f, 0.0f)));
+    }
     
-    process(glfwGetTime());
+    // Time goes on smoothly from one frame to the next, in between the last two steps
+    float blend = _accumulator / STEP;
+    process(std::max(0., _time - STEP + blend * STEP));
+    ParticuleManager::BLEND = blend;
+    if (_light)
+        _light->bind(defaultShader());
     
+    PROFILE_SCOPE("Scene::draw");
+    PROFILE_GPU_SCOPE("Scene");
     _main_node->draw(_active_camera->projectionMatrix(), _active_camera->viewMatrix(), glm::mat4(1.f));
 }
 
@@ -307,13 +327,37 @@ void Scene::playAnimation( int anim){
     }
     
     Animation* a = _animations[anim];
+    
+    if (a && BakedAnimation::RATE > 0.f){
+        BakedAnimation* baked = bakedAnimation(anim);
+        for (AnimationInstance* i: _instances)
+            if (i->clip() == baked)
+                return;
+        DEBUG(Debug::Info, "Playing baked animation %s\n", a->name().c_str());
+        _instances.push_back(new AnimationInstance(baked));
+        return;
+    }
         
     if (a && _current_animation.find(a) == _current_animation.end()){
         DEBUG(Debug::Info, "Playing animation %s\n", a->name().c_str());
+        a->bind();
         _current_animation.insert(a);        
     }
 }
 
+BakedAnimation* Scene::bakedAnimation(int anim){
+    if (_animations.size() <= anim || BakedAnimation::RATE <= 0.f)
+        return nullptr;
+    
+    Animation* a = _animations[anim];
+    auto it = _baked.find(a);
+    if (it != _baked.end())
+        return it->second;
+    BakedAnimation* baked = new BakedAnimation(a, BakedAnimation::RATE);
+    _baked.insert(std::make_pair(a, baked));
+    return baked;
+}
+
 void Scene::addMesh(Mesh* m){
     _models.push_back(m);
 }
@@ -337,6 +381,7 @@ void Scene::_parseNode(Node* current, aiNode ** children, unsigned int nb_child)
             
         Node* n = new Node(curr_child->mName.data, aiMatrix4x4toglmMat4(curr_child->mTransformation), this, current);
         for (int v = 0; v < curr_child->mNumMeshes; v++){
+            getMesh(curr_child->mMeshes[v])->node(n);
             n->addChild("", getMesh(curr_child->mMeshes[v]));
         }
         _parseNode(n, curr_child->mChildren, curr_child->mNumChildren);   
@@ -454,10 +499,32 @@ void Node::draw(glm::mat4 projection, glm::mat4 view, glm::mat4 model){
 
 
 
+int Scene::advance(double elapsed){
+    PROFILE_SCOPE("Scene::advance");
+    _accumulator += elapsed;
+    
+    int steps = 0;
+    while (_accumulator >= STEP && steps < MAX_STEPS){
+        step(STEP);
+        _time += STEP;
+        _accumulator -= STEP;
+        steps++;
+    }
+    if (_accumulator >= STEP)
+        _accumulator = fmod(_accumulator, STEP);
+    return steps;
+}
+
+void Scene::step(float dt){
+    ParticuleManager::updateAll(dt);
+}
+
 void Scene::process(float timeInSeconds){
+    PROFILE_SCOPE("Scene::process");
+    
+    if (_light)
+        _light->setPos(glm::vec3(fmod(timeInSeconds, 20), 10.0, 1.0));
     
     //~ defaultShader()->use();
-    for (Animation* a: _current_animation){
-        a->applyBones(fmod(a->timeInTick(timeInSeconds), a->duration()), this);
-    }
+    Animation::play(std::vector<Animation*>(_current_animation.begin(), _current_animation.end()), _instances, timeInSeconds, _active_camera);
 }
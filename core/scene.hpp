@@ -27,6 +27,8 @@ class Light;
 class Node;
 class Shader;
 class Animation;
+class BakedAnimation;
+class AnimationInstance;
 
 
 class SceneException: public std::exception {
@@ -68,15 +70,49 @@ class Scene {
             return it->second;
         }
         
+        /**!
+         * \short Run the fixed simulation steps that fit in the time elapsed since the last call
+         * At most MAX_STEPS are run, the time left beyond is dropped rather than caught up with
+         * ever longer frames.
+         * \return The number of steps run
+         */
+        int advance(double elapsed);
+        
+        /**!
+         * \short One simulation step of dt seconds: particles
+         */
+        void step(float dt);
+        
+        /**!
+         * \short Pose animations and the light at that time
+         */
         void process(float timestamp);
+        
+        /**!
+         * \short Draw the scene in between the last two simulation steps
+         */
         void render();
+        
+        inline double time() const { return _time; }
         void displayNodeTree();
         void addLight(Light*l) {_light = l;};
         Light*light(){return _light;};
         
         static Scene* import(std::string path, Shader* s);
         
+        static float STEP;          // seconds of simulation per step
+        static int MAX_STEPS;       // per call to advance
+        
+        /**!
+         * \short Play an animation from its keys, or from its baked frames when BakedAnimation::RATE is set
+         */
         void playAnimation( int anim);
+        
+        /**!
+         * \short Frames of the animation at BakedAnimation::RATE, baked on first call
+         */
+        BakedAnimation* bakedAnimation(int anim);
+        inline void addAnimationInstance(AnimationInstance* i){ _instances.push_back(i); }
 
         
         
@@ -87,9 +123,14 @@ class Scene {
         std::vector<Animation*> _animations;
         
         std::set<Animation*> _current_animation;
+        std::map<Animation*, BakedAnimation*> _baked;
+        std::vector<AnimationInstance*> _instances;
         std::set<Camera*> _cameras;
 
         Light* _light;
+        
+        double _time;           // simulated seconds, a whole number of steps
+        double _accumulator;    // elapsed seconds not simulated yet, less than a step after advance
 
         Skybox *_skybox;
 
@@ -133,6 +174,11 @@ class Node: public Drawable {
         inline void parent(Node* p) { _parent = p; }
         
         inline glm::mat4 inverseTransformation() const { return (_parent ? _parent->inverseTransformation() * _transformation: glm::mat4(1.f) * _transformation);}
+        
+        /**!
+         * \short Global transformation in the usual column vector convention, stored matrices being transposed
+         */
+        inline glm::mat4 globalTransformation() const { return _parent ? _parent->globalTransformation() * glm::transpose(_transformation) : glm::transpose(_transformation); }
     private:
         std::multimap<std::string, Drawable*> _children;
         
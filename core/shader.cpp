@@ -5,67 +5,130 @@
 #include <fstream>
 #include <sstream>
 #include <vector>
+#include <algorithm>
+#include <chrono>
+#include <sys/stat.h>
+
+#define SHADER_CACHE_DIR_PARENT "cache"
+#define SHADER_CACHE_DIR "cache/shaders"
+#define SHADER_CACHE_MAGIC 0x42535050 // "PPSB"
 
 using namespace std;
 
 GLuint Shader::SHADER_IN_USE = 0;
+bool Shader::STRICT_UNIFORMS = false;
+bool Shader::BINARY_CACHE = true;
+bool Shader::PARALLEL_COMPILE_INIT = false;
+std::vector<Shader*> Shader::INSTANCES;
 
-Shader::Shader(string VertexShaderCode, string FragmentShaderCode){
-    GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
-	GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
-    GLint Result = GL_FALSE;
-	int InfoLogLength;
+Shader::Shader(string VertexShaderCode, string FragmentShaderCode, bool lazy):
+    _programe_id(0), _vertex_id(0), _fragment_id(0), _state(Pending), _from_cache(false),
+    _hash(_sourceHash(VertexShaderCode, FragmentShaderCode)),
+    _compile_ms(0)
+{
+    if (!PARALLEL_COMPILE_INIT){
+        // Let the driver compile on as many threads as it likes
+        if (GLEW_KHR_parallel_shader_compile)
+            glMaxShaderCompilerThreadsKHR(0xffffffff);
+        else if (GLEW_ARB_parallel_shader_compile)
+            glMaxShaderCompilerThreadsARB(0xffffffff);
+        PARALLEL_COMPILE_INIT = true;
+    }
+    
+    _vertex_code = VertexShaderCode;
+    _fragment_code = FragmentShaderCode;
+    
+    _compile_start = std::chrono::steady_clock::now();
+    if (BINARY_CACHE && _loadBinary(_hash)){
+        _compile_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - _compile_start).count();
+        _state = Ready;
+        _reflect();
+    } else if (!lazy)
+        _startCompile();
+
+    INSTANCES.push_back(this);
+}
 
+bool Shader::ready() const {
+    if (_state == Ready)
+        return true;
+    if (_state == Pending)
+        return false;
+        
+    // Non blocking query, only meaningful with parallel compile
+    GLint done = GL_TRUE;
+    if (GLEW_KHR_parallel_shader_compile || GLEW_ARB_parallel_shader_compile)
+        glGetProgramiv(_programe_id, GL_COMPLETION_STATUS_KHR, &done);
+    return done == GL_TRUE;
+}
+
+void Shader::_startCompile(){
+    _compile_start = std::chrono::steady_clock::now();
+    _vertex_id = glCreateShader(GL_VERTEX_SHADER);
+	_fragment_id = glCreateShader(GL_FRAGMENT_SHADER);
+	
     GLenum err;
 	// Compile Vertex Shader
 	DEBUG(Debug::Info, "Compiling shader\n");
-	char const * VertexSourcePointer = VertexShaderCode.c_str();
+	char const * VertexSourcePointer = _vertex_code.c_str();
 	//printf("Vertex source path: %s\n", VertexSourcePointer);
-	glShaderSource(VertexShaderID, 1, &VertexSourcePointer , NULL);
+	glShaderSource(_vertex_id, 1, &VertexSourcePointer , NULL);
 	
 	while ((err = glGetError()) != GL_NO_ERROR)
         throw new OpenGLException("Shader initialisation", err);
         
-	glCompileShader(VertexShaderID);
+	glCompileShader(_vertex_id);
 
+	// Compile Fragment Shader
+	DEBUG(Debug::Info, "Compiling shader\n");
+	char const * FragmentSourcePointer = _fragment_code.c_str();
+	glShaderSource(_fragment_id, 1, &FragmentSourcePointer , NULL);
+	glCompileShader(_fragment_id);
+
+	// Link the program, without querying anything so that the driver is not forced to finish
+	DEBUG(Debug::Info, "Linking program\n");
+	_programe_id = glCreateProgram();
+	glAttachShader(_programe_id, _vertex_id);
+	glAttachShader(_programe_id, _fragment_id);
+	if (BINARY_CACHE && GLEW_ARB_get_program_binary)
+	    glProgramParameteri(_programe_id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	glLinkProgram(_programe_id);
+	
+	_state = Compiling;
+}
+
+void Shader::_finalize(){
+    if (_state == Pending)
+        _startCompile();
+        
+    GLint Result = GL_FALSE;
+	int InfoLogLength;
+    GLenum err;
+    
 	// Check Vertex Shader
-	glGetShaderiv(VertexShaderID, GL_COMPILE_STATUS, &Result);
-	glGetShaderiv(VertexShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+	glGetShaderiv(_vertex_id, GL_COMPILE_STATUS, &Result);
+	glGetShaderiv(_vertex_id, GL_INFO_LOG_LENGTH, &InfoLogLength);
 	if ( InfoLogLength > 0 ){
 		std::vector<char> VertexShaderErrorMessage(InfoLogLength+1);
-		glGetShaderInfoLog(VertexShaderID, InfoLogLength, NULL, &VertexShaderErrorMessage[0]);
+		glGetShaderInfoLog(_vertex_id, InfoLogLength, NULL, &VertexShaderErrorMessage[0]);
 		DEBUG(Debug::Warning, "%s\n", &VertexShaderErrorMessage[0]);
 	}
 
 	while ((err = glGetError()) != GL_NO_ERROR)
         throw new OpenGLException("Vertex compilation", err);
 
-
-	// Compile Fragment Shader
-	DEBUG(Debug::Info, "Compiling shader\n");
-	char const * FragmentSourcePointer = FragmentShaderCode.c_str();
-	glShaderSource(FragmentShaderID, 1, &FragmentSourcePointer , NULL);
-	glCompileShader(FragmentShaderID);
-
 	// Check Fragment Shader
-	glGetShaderiv(FragmentShaderID, GL_COMPILE_STATUS, &Result);
-	glGetShaderiv(FragmentShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+	glGetShaderiv(_fragment_id, GL_COMPILE_STATUS, &Result);
+	glGetShaderiv(_fragment_id, GL_INFO_LOG_LENGTH, &InfoLogLength);
 	if ( InfoLogLength > 0 ){
 		std::vector<char> FragmentShaderErrorMessage(InfoLogLength+1);
-		glGetShaderInfoLog(FragmentShaderID, InfoLogLength, NULL, &FragmentShaderErrorMessage[0]);
+		glGetShaderInfoLog(_fragment_id, InfoLogLength, NULL, &FragmentShaderErrorMessage[0]);
 		DEBUG(Debug::Warning, "%s\n", &FragmentShaderErrorMessage[0]);
 	}
 
 	while ((err = glGetError()) != GL_NO_ERROR)
         throw new OpenGLException("Fragment compilation", err);
 
-	// Link the program
-	DEBUG(Debug::Info, "Linking program\n");
-	_programe_id = glCreateProgram();
-	glAttachShader(_programe_id, VertexShaderID);
-	glAttachShader(_programe_id, FragmentShaderID);
-	glLinkProgram(_programe_id);
-
 	// Check the program
 	glGetProgramiv(_programe_id, GL_LINK_STATUS, &Result);
 	glGetProgramiv(_programe_id, GL_INFO_LOG_LENGTH, &InfoLogLength);
@@ -76,21 +139,235 @@ Shader::Shader(string VertexShaderCode, string FragmentShaderCode){
 	}
 
 	
-	glDetachShader(_programe_id, VertexShaderID);
-	glDetachShader(_programe_id, FragmentShaderID);
+	glDetachShader(_programe_id, _vertex_id);
+	glDetachShader(_programe_id, _fragment_id);
 	
-	glDeleteShader(VertexShaderID);
-	glDeleteShader(FragmentShaderID);
+	glDeleteShader(_vertex_id);
+	glDeleteShader(_fragment_id);
+	_vertex_id = _fragment_id = 0;
 	while ((err = glGetError()) != GL_NO_ERROR)
         throw new OpenGLException("Impossible finalyse shader loading", 0);
+    
+    _state = Ready;
+    _compile_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - _compile_start).count();
+        
+    // A program that failed to link would be loaded from the cache as is, and never compiled again
+    if (BINARY_CACHE && Result == GL_TRUE)
+        _storeBinary(_hash);
+    _reflect();
+    _logTiming();
+}
+
+void Shader::_logTiming() const {
+	// Compilation runs in the background until the first use waits for it, whatever else the program did meanwhile is counted
+	std::cout << "Shader " << _name << (_from_cache ? ": cache hit, loaded in " : ": compiled, ready for first use ") << std::fixed << std::setprecision(2)
+	          << _compile_ms << (_from_cache ? " ms" : " ms after submission") << std::endl;
+}
+
+string Shader::_withDefines(const string& code, const std::set<string>& defines){
+    // Defines go right after the #version directive, which has to stay first
+    size_t version = code.find("#version");
+    size_t insert = version == string::npos ? 0 : code.find('\n', version) + 1;
+    
+    string header;
+    for (const string& d: defines)
+        header += "#define " + d + "\n";
+    return code.substr(0, insert) + header + code.substr(insert);
+}
+
+Shader* Shader::variant(const std::set<string>& defines){
+    if (defines.empty())
+        return this;
+        
+    auto it = _variants.find(defines);
+    if (it != _variants.end())
+        return it->second;
+        
+    Shader* v = new Shader(_withDefines(_vertex_code, defines), _withDefines(_fragment_code, defines));
+    
+    string name = _name + "[";
+    for (const string& d: defines)
+        name += (name.back() == '[' ? "" : ",") + d;
+    v->name(name + "]");
+    if (v->_from_cache)
+        v->_logTiming();
+        
+    _variants.insert(std::make_pair(defines, v));
+    return v;
+}
 
+std::vector<Shader*> Shader::variants(){
+    std::vector<Shader*> all(1, this);
+    for (auto v: _variants)
+        all.push_back(v.second);
+    return all;
+}
+
+uint64_t Shader::_sourceHash(const string& vertex, const string& fragment){
+    // FNV-1a, both stages separated so that moving code between them changes the key
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const string* src: {&vertex, &fragment}){
+        for (unsigned char c: *src)
+            hash = (hash ^ c) * 0x100000001b3ULL;
+        hash = (hash ^ 0xff) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+string Shader::_driverId(){
+    return string((const char*)glGetString(GL_VENDOR)) + '\n' + (const char*)glGetString(GL_RENDERER) + '\n' + (const char*)glGetString(GL_VERSION);
+}
+
+string Shader::_cachePath(uint64_t hash){
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)hash);
+    return string(SHADER_CACHE_DIR) + "/" + name;
+}
+
+bool Shader::_loadBinary(uint64_t hash){
+    if (!GLEW_ARB_get_program_binary)
+        return false;
+        
+    std::ifstream in(_cachePath(hash), ios::in | ios::binary);
+    if (!in.is_open())
+        return false;
+    
+    uint32_t magic = 0, driver_length = 0, length = 0;
+    uint64_t stored_hash = 0;
+    GLenum format = 0;
+    
+    in.read((char*)&magic, sizeof(magic));
+    in.read((char*)&stored_hash, sizeof(stored_hash));
+    in.read((char*)&driver_length, sizeof(driver_length));
+    if (!in || magic != SHADER_CACHE_MAGIC || stored_hash != hash || driver_length > 4096)
+        return false;
+        
+    string driver(driver_length, '\0');
+    in.read(&driver[0], driver_length);
+    in.read((char*)&format, sizeof(format));
+    in.read((char*)&length, sizeof(length));
+    if (!in || driver != _driverId())
+        return false;
+    
+    // A truncated or corrupted entry could claim anything, the binary is at most the rest of the file
+    std::streampos start = in.tellg();
+    in.seekg(0, ios::end);
+    std::streamoff left = in.tellg() - start;
+    in.seekg(start);
+    if (length == 0 || (std::streamoff)length > left)
+        return false;
+    
+    std::vector<char> binary(length);
+    in.read(&binary[0], length);
+    if (!in)
+        return false;
+    
+    _programe_id = glCreateProgram();
+    glProgramBinary(_programe_id, format, &binary[0], length);
+    
+    // The driver is free to reject a binary, fall back on compilation then
+    GLint status = GL_FALSE;
+    glGetProgramiv(_programe_id, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE){
+        DEBUG(Debug::Warning, "Cached program %s rejected by the driver, recompiling\n", _cachePath(hash).c_str());
+        glDeleteProgram(_programe_id);
+        _programe_id = 0;
+        return false;
+    }
+    
+    _from_cache = true;
+    return true;
+}
+
+void Shader::_storeBinary(uint64_t hash){
+    if (!GLEW_ARB_get_program_binary)
+        return;
+        
+    GLint length = 0;
+    glGetProgramiv(_programe_id, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return;
+        
+    std::vector<char> binary(length);
+    GLenum format;
+    glGetProgramBinary(_programe_id, length, nullptr, &format, &binary[0]);
+    
+    mkdir(SHADER_CACHE_DIR_PARENT, 0755);
+    mkdir(SHADER_CACHE_DIR, 0755);
+    std::ofstream out(_cachePath(hash), ios::out | ios::binary | ios::trunc);
+    if (!out.is_open()){
+        DEBUG(Debug::Warning, "Cannot write shader cache %s\n", _cachePath(hash).c_str());
+        return;
+    }
+    
+    string driver = _driverId();
+    uint32_t magic = SHADER_CACHE_MAGIC, driver_length = driver.size(), binary_length = length;
+    out.write((const char*)&magic, sizeof(magic));
+    out.write((const char*)&hash, sizeof(hash));
+    out.write((const char*)&driver_length, sizeof(driver_length));
+    out.write(driver.data(), driver_length);
+    out.write((const char*)&format, sizeof(format));
+    out.write((const char*)&binary_length, sizeof(binary_length));
+    out.write(&binary[0], binary_length);
 }
 
 Shader::~Shader(){
-    glDeleteProgram(_programe_id);
+    for (auto v: _variants)
+        delete v.second;
+    INSTANCES.erase(std::remove(INSTANCES.begin(), INSTANCES.end(), this), INSTANCES.end());
+    if (_vertex_id)
+        glDeleteShader(_vertex_id);
+    if (_fragment_id)
+        glDeleteShader(_fragment_id);
+    if (_programe_id)
+        glDeleteProgram(_programe_id);
 }
 
-Shader* Shader::fromFiles(string vertex_file_path, string fragment_file_path){
+void Shader::_reflect(){
+    GLint count = 0, max_length = 0;
+    glGetProgramiv(_programe_id, GL_ACTIVE_UNIFORMS, &count);
+    glGetProgramiv(_programe_id, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_length);
+    
+    std::vector<GLchar> name(max_length + 1);
+    for (GLint i = 0; i < count; i++){
+        GLint size;
+        GLenum type;
+        glGetActiveUniform(_programe_id, i, name.size(), nullptr, &size, &type, &name[0]);
+        _uniforms[&name[0]] = glGetUniformLocation(_programe_id, &name[0]);
+    }
+}
+
+GLint Shader::_location(const std::string &name) const {
+    // A shader still pending has no program yet, and 0 is also what SHADER_IN_USE holds after deuse
+    if (_state != Ready || SHADER_IN_USE != _programe_id) 
+        throw new ShaderNotUseException(this);
+        
+    auto it = _uniforms.find(name);
+    if (it == _uniforms.end())
+        // Not reflected, either an array element or a uniform optimized out: ask once
+        it = _uniforms.insert(std::make_pair(name, glGetUniformLocation(_programe_id, name.c_str()))).first;
+        
+    if (it->second < 0){
+        if (STRICT_UNIFORMS)
+            throw new ShaderUniformNotFoundException("No uniform '"+ name + "' found in the shader");
+        if (_missing.insert(name).second)
+            DEBUG(Debug::Verbose, "Shader '%s' has no uniform '%s', ignoring it\n", _name.c_str(), name.c_str());
+    }
+    return it->second;
+}
+
+void Shader::reportMissingUniforms(){
+    for (Shader* s: INSTANCES){
+        if (s->_missing.empty())
+            continue;
+        std::cout << "Shader '" << s->_name << "' (program " << s->_programe_id << ") never consumes:";
+        for (const std::string& u: s->_missing)
+            std::cout << " " << u;
+        std::cout << std::endl;
+    }
+}
+
+Shader* Shader::fromFiles(string vertex_file_path, string fragment_file_path, bool lazy){
 
 	// Create the shaders
 	
@@ -117,23 +394,25 @@ Shader* Shader::fromFiles(string vertex_file_path, string fragment_file_path){
 	} else
         throw new OpenGLException("Impossible to open " + fragment_file_path, 0);
 
-	return new Shader(VertexShaderCode, FragmentShaderCode);
+	Shader* s = new Shader(VertexShaderCode, FragmentShaderCode, lazy);
+	s->name(fragment_file_path);
+	if (s->_from_cache)
+	    s->_logTiming();
+	return s;
 }
 
 
 GLuint Shader::getUniformLocation(std::string id){
-    if (SHADER_IN_USE != _programe_id) 
-        throw new ShaderNotUseException(this);
-    return getUniformLocation(id.c_str());
+    return _location(id);
 }
 
 GLuint Shader::getUniformLocation(const char* id){
-    if (SHADER_IN_USE != _programe_id) 
-        throw new ShaderNotUseException(this);
-    return glGetUniformLocation(_programe_id, id);
+    return _location(id);
 }
 
 void Shader::use() {
+    if (_state != Ready)
+        _finalize();
     if (SHADER_IN_USE != _programe_id){
         SHADER_IN_USE = _programe_id;
         glUseProgram(_programe_id);
@@ -147,45 +426,65 @@ void Shader::deuse() {
 }
 
 void Shader::setVec3(const std::string &name, const glm::vec3 &value) const {
-	Debug::CheckOpenGLError("Set vec3");
-    if (SHADER_IN_USE != _programe_id) 
-        throw new ShaderNotUseException(this);
-    if (glGetUniformLocation(_programe_id, name.c_str()) < 0) 
-        throw new ShaderUniformNotFoundException("No uniform '"+ name + "' found in the shader");
-    glUniform3fv(glGetUniformLocation(_programe_id, name.c_str()), 1, &value[0]); 
+	GL_CHECK("Shader::setVec3");
+    GLint location = _location(name);
+    if (location >= 0)
+        glUniform3fv(location, 1, &value[0]); 
 }        
 void Shader::setVec3(const std::string &name, float x, float y, float z) const {
-    if (SHADER_IN_USE != _programe_id) 
-        throw new ShaderNotUseException(this);
-    if (glGetUniformLocation(_programe_id, name.c_str()) < 0) 
-        throw new ShaderUniformNotFoundException("No uniform '"+ name + "' found in the shader");
-    glUniform3f(glGetUniformLocation(_programe_id, name.c_str()), x, y, z); 
+    GLint location = _location(name);
+    if (location >= 0)
+        glUniform3f(location, x, y, z); 
+}
+void Shader::setMat3(const std::string &name, const glm::mat3 &mat) const {
+    GLint location = _location(name);
+    if (location >= 0)
+        glUniformMatrix3fv(location, 1, GL_FALSE, &mat[0][0]);
 }
 void Shader::setMat4(const std::string &name, const glm::mat4 &mat, bool inverse) const {
-    if (SHADER_IN_USE != _programe_id) 
-        throw new ShaderNotUseException(this);
-    if (glGetUniformLocation(_programe_id, name.c_str()) < 0) 
-        throw new ShaderUniformNotFoundException("No uniform '"+ name + "' found in the shader");
-    glUniformMatrix4fv(glGetUniformLocation(_programe_id, name.c_str()), 1, inverse, &mat[0][0]);
+    GLint location = _location(name);
+    if (location >= 0)
+        glUniformMatrix4fv(location, 1, inverse, &mat[0][0]);
+}
+void Shader::setMat4Array(const std::string &name, GLsizei count, const glm::mat4* mats) const {
+    GLint location = _location(name);
+    if (location >= 0)
+        glUniformMatrix4fv(location, count, GL_FALSE, &mats[0][0][0]);
 }
 void Shader::setFloat(const std::string &name, float val) const {
-    if (SHADER_IN_USE != _programe_id) 
-        throw new ShaderNotUseException(this);
-    if (glGetUniformLocation(_programe_id, name.c_str()) < 0) 
-        throw new ShaderUniformNotFoundException("No uniform '"+ name + "' found in the shader");
-    glUniform1f(glGetUniformLocation(_programe_id, name.c_str()), val);
+    GLint location = _location(name);
+    if (location >= 0)
+        glUniform1f(location, val);
 }
 void Shader::setInt(const std::string &name, int val) const {
-    if (SHADER_IN_USE != _programe_id) 
-        throw new ShaderNotUseException(this);
-    if (glGetUniformLocation(_programe_id, name.c_str()) < 0) 
-        throw new ShaderUniformNotFoundException("No uniform '"+ name + "' found in the shader");
-    glUniform1i(glGetUniformLocation(_programe_id, name.c_str()), val);
+    GLint location = _location(name);
+    if (location >= 0)
+        glUniform1i(location, val);
 }
 void Shader::setBool(const std::string &name, bool val) const {
-    if (SHADER_IN_USE != _programe_id) 
-        throw new ShaderNotUseException(this);
-    if (glGetUniformLocation(_programe_id, name.c_str()) < 0) 
-        throw new ShaderUniformNotFoundException("No uniform '"+ name + "' found in the shader");
-    glUniform1i(glGetUniformLocation(_programe_id, name.c_str()), val);
+    GLint location = _location(name);
+    if (location >= 0)
+        glUniform1i(location, val);
+}
+void Shader::setSampler(const std::string &name, GLuint unit) const {
+    GLint location = _location(name);
+    if (location < 0)
+        return;
+    auto it = _samplers.find(location);
+    if (it != _samplers.end() && it->second == unit)
+        return;
+    glUniform1i(location, unit);
+    _samplers[location] = unit;
+    _handles.erase(location);
+}
+void Shader::setHandle(const std::string &name, GLuint64 handle) const {
+    GLint location = _location(name);
+    if (location < 0)
+        return;
+    auto it = _handles.find(location);
+    if (it != _handles.end() && it->second == handle)
+        return;
+    glUniformHandleui64ARB(location, handle);
+    _handles[location] = handle;
+    _samplers.erase(location);
 }
@@ -2,6 +2,11 @@
 #define SHADER_H
 
 #include <string>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <vector>
+#include <chrono>
 #include <GL/glew.h>
 #include <glm/glm.hpp>
 
@@ -18,7 +23,12 @@ class ShaderUniformNotFoundException : public ShaderException {
 
 class Shader {
     public:
-        Shader(std::string vertex, std::string fragment);
+        /**!
+         * \short Start compiling and linking a program without waiting for the driver
+         * Compilation status is only queried the first time the program is used.
+         * \param lazy Do not even submit the sources before the first use
+         */
+        Shader(std::string vertex, std::string fragment, bool lazy = false);
         ~Shader();
         
         GLuint getUniformLocation(std::string id);
@@ -27,23 +37,103 @@ class Shader {
         void use();
         void deuse();
         
+        /**!
+         * \short Whether use() can be called without blocking on the driver
+         */
+        bool ready() const;
+        
         void setVec3(const std::string &name, const glm::vec3 &value) const;
         void setVec3(const std::string &name, float x, float y, float z) const;
+        void setMat3(const std::string &name, const glm::mat3 &mat) const;
         void setMat4(const std::string &name, const glm::mat4 &mat, bool inverse = GL_FALSE) const;
+        void setMat4Array(const std::string &name, GLsizei count, const glm::mat4* mats) const;
         void setFloat(const std::string &name, float val) const;
         void setInt(const std::string &name, int val) const;
         void setBool(const std::string &name, bool val) const;
+        
+        /**!
+         * \short Point a sampler at a texture unit, or at a bindless texture handle
+         * The value is remembered, setting the one the program already has costs no GL call.
+         */
+        void setSampler(const std::string &name, GLuint unit) const;
+        void setHandle(const std::string &name, GLuint64 handle) const;
 
         inline std::string name() const { return _name; }
         inline void name(std::string name) { _name = name; }
         
-        static Shader* fromFiles(std::string vertex_path, std::string fragment_path);
+        /**!
+         * \short Print, for every program, the uniforms it was given but never consumes
+         */
+        static void reportMissingUniforms();
+        
+        static Shader* fromFiles(std::string vertex_path, std::string fragment_path, bool lazy = false);
+        
+        /**!
+         * \short Get the program specialized for a set of preprocessor defines
+         * Variants are built from this program sources, compiled once and shared
+         * by every caller asking for the same set. An empty set returns this program.
+         */
+        Shader* variant(const std::set<std::string>& defines);
+        
+        /**!
+         * \short This program followed by all the variants built so far
+         */
+        std::vector<Shader*> variants();
+        
+        /**!
+         * \short Throw ShaderUniformNotFoundException on absent uniforms instead of ignoring them
+         * Meant for debugging only, setters are silent no-ops on absent uniforms by default.
+         */
+        static bool STRICT_UNIFORMS;
+        
+        /**!
+         * \short Reuse linked programs from cache/shaders through glProgramBinary
+         * Entries are keyed by the source hash and checked against the driver
+         * vendor, renderer and version strings before being used.
+         */
+        static bool BINARY_CACHE;
     private:
+        enum State {Pending, Compiling, Ready};
+        
+        void _startCompile();
+        void _finalize();
+        void _logTiming() const;
+        bool _loadBinary(uint64_t hash);
+        void _storeBinary(uint64_t hash);
+        void _reflect();
+        
+        static std::string _withDefines(const std::string& code, const std::set<std::string>& defines);
+        static uint64_t _sourceHash(const std::string& vertex, const std::string& fragment);
+        static std::string _driverId();
+        static std::string _cachePath(uint64_t hash);
+        
+        GLint _location(const std::string &name) const;
+        
         GLuint _programe_id;
+        GLuint _vertex_id, _fragment_id;
+        State _state;
+        bool _from_cache;
+        
+        // Sources are kept to build variants
+        std::string _vertex_code, _fragment_code;
+        std::map<std::set<std::string>, Shader*> _variants;
+        uint64_t _hash;
+        std::chrono::steady_clock::time_point _compile_start;   // of the compilation or of the binary load
+        double _compile_ms;                                     // from there until the first use found the program ready
         
         std::string _name;
         
+        // Locations memoized by name, absent uniforms are stored as -1
+        mutable std::map<std::string, GLint> _uniforms;
+        mutable std::set<std::string> _missing;
+        
+        // Last values given to sampler uniforms, by location
+        mutable std::map<GLint, GLuint> _samplers;
+        mutable std::map<GLint, GLuint64> _handles;
+        
         static GLuint SHADER_IN_USE;
+        static bool PARALLEL_COMPILE_INIT;
+        static std::vector<Shader*> INSTANCES;
         
         
         
@@ -0,0 +1,212 @@
+#include "skinning.hpp"
+#include "common.hpp"
+#include "jobs.hpp"
+#include "profiler.hpp"
+
+#include <cstdlib>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define SKIN_SSE
+#include <xmmintrin.h>
+#endif
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+Skin::Mode Skin::MODE = Skin::GPU;
+size_t Skin::GRAIN = 2048;
+
+Skin::Skin(const std::vector<GLfloat>& positions, const std::vector<GLfloat>& normals){
+    size_t count = positions.size() / 3;
+    _positions.resize(count * 4);
+    for (size_t v = 0; v < count; v++){
+        _positions[v * 4 + 0] = positions[v * 3 + 0];
+        _positions[v * 4 + 1] = positions[v * 3 + 1];
+        _positions[v * 4 + 2] = positions[v * 3 + 2];
+        _positions[v * 4 + 3] = 1.f;
+    }
+
+    if (normals.size() == positions.size()){
+        _normals.resize(count * 4);
+        for (size_t v = 0; v < count; v++){
+            _normals[v * 4 + 0] = normals[v * 3 + 0];
+            _normals[v * 4 + 1] = normals[v * 3 + 1];
+            _normals[v * 4 + 2] = normals[v * 3 + 2];
+            _normals[v * 4 + 3] = 0.f;
+        }
+    }
+
+    _bones.assign(count * SKIN_INFLUENCES, 0);
+    _weights.assign(count * SKIN_INFLUENCES, 0.f);
+    _skinned_positions = _positions;
+    _skinned_normals = _normals;
+}
+
+void Skin::setInfluences(const std::vector<GLint>& bones, const std::vector<GLfloat>& weights){
+    _bones = bones;
+    _weights = weights;
+}
+
+std::vector<GLfloat> Skin::bindPositions() const {
+    std::vector<GLfloat> out;
+    out.reserve(size() * 3);
+    for (size_t v = 0; v < size(); v++)
+        out.insert(out.end(), &_positions[v * 4], &_positions[v * 4 + 3]);
+    return out;
+}
+
+std::vector<GLfloat> Skin::bindNormals() const {
+    std::vector<GLfloat> out;
+    out.reserve(_normals.size() / 4 * 3);
+    for (size_t v = 0; v < _normals.size() / 4; v++)
+        out.insert(out.end(), &_normals[v * 4], &_normals[v * 4 + 3]);
+    return out;
+}
+
+void Skin::apply(const std::vector<glm::mat4>& palette){
+    const GLfloat* normals = hasNormals() ? &_normals[0] : nullptr;
+    GLfloat* skinned_normals = hasNormals() ? &_skinned_normals[0] : nullptr;
+
+    JobSystem::parallelFor(size(), GRAIN, [&](size_t begin, size_t end){
+        skinRange(&_positions[0], normals, &_bones[0], &_weights[0], &palette[0],
+                  &_skinned_positions[0], skinned_normals, begin, end);
+    });
+}
+
+void Skin::skinRangeScalar(const GLfloat* positions_in, const GLfloat* normals_in, const GLint* bones, const GLfloat* weights,
+                           const glm::mat4* palette, GLfloat* positions_out, GLfloat* normals_out, size_t begin, size_t end){
+    for (size_t v = begin; v < end; v++){
+        const GLint* id = bones + v * SKIN_INFLUENCES;
+        const GLfloat* w = weights + v * SKIN_INFLUENCES;
+
+        glm::mat4 m = glm::mat4(1.f) * (1.f - w[0] - w[1] - w[2] - w[3]);
+        for (int k = 0; k < SKIN_INFLUENCES; k++)
+            m += palette[id[k]] * w[k];
+
+        glm::vec4 p = m * glm::vec4(positions_in[v * 4], positions_in[v * 4 + 1], positions_in[v * 4 + 2], 1.f);
+        positions_out[v * 4 + 0] = p.x;
+        positions_out[v * 4 + 1] = p.y;
+        positions_out[v * 4 + 2] = p.z;
+        positions_out[v * 4 + 3] = 1.f;
+
+        if (normals_in){
+            glm::vec4 n = m * glm::vec4(normals_in[v * 4], normals_in[v * 4 + 1], normals_in[v * 4 + 2], 0.f);
+            normals_out[v * 4 + 0] = n.x;
+            normals_out[v * 4 + 1] = n.y;
+            normals_out[v * 4 + 2] = n.z;
+            normals_out[v * 4 + 3] = 0.f;
+        }
+    }
+}
+
+#ifdef SKIN_SSE
+#define SKIN_SPLAT(v, i) _mm_shuffle_ps(v, v, _MM_SHUFFLE(i, i, i, i))
+
+void Skin::skinRange(const GLfloat* positions_in, const GLfloat* normals_in, const GLint* bones, const GLfloat* weights,
+                     const glm::mat4* palette, GLfloat* positions_out, GLfloat* normals_out, size_t begin, size_t end){
+    for (size_t v = begin; v < end; v++){
+        const GLint* id = bones + v * SKIN_INFLUENCES;
+        const GLfloat* w = weights + v * SKIN_INFLUENCES;
+        float rest = 1.f - w[0] - w[1] - w[2] - w[3];
+
+        // Blend the palette matrices column by column, glm::mat4 being column major
+#ifdef __AVX__
+        __m256 c01 = _mm256_setr_ps(rest, 0.f, 0.f, 0.f, 0.f, rest, 0.f, 0.f);
+        __m256 c23 = _mm256_setr_ps(0.f, 0.f, rest, 0.f, 0.f, 0.f, 0.f, rest);
+        for (int k = 0; k < SKIN_INFLUENCES; k++){
+            const float* m = &palette[id[k]][0][0];
+            __m256 wk = _mm256_set1_ps(w[k]);
+            c01 = _mm256_add_ps(c01, _mm256_mul_ps(_mm256_loadu_ps(m), wk));
+            c23 = _mm256_add_ps(c23, _mm256_mul_ps(_mm256_loadu_ps(m + 8), wk));
+        }
+        __m128 c0 = _mm256_castps256_ps128(c01), c1 = _mm256_extractf128_ps(c01, 1);
+        __m128 c2 = _mm256_castps256_ps128(c23), c3 = _mm256_extractf128_ps(c23, 1);
+#else
+        __m128 c0 = _mm_setr_ps(rest, 0.f, 0.f, 0.f);
+        __m128 c1 = _mm_setr_ps(0.f, rest, 0.f, 0.f);
+        __m128 c2 = _mm_setr_ps(0.f, 0.f, rest, 0.f);
+        __m128 c3 = _mm_setr_ps(0.f, 0.f, 0.f, rest);
+        for (int k = 0; k < SKIN_INFLUENCES; k++){
+            const float* m = &palette[id[k]][0][0];
+            __m128 wk = _mm_set1_ps(w[k]);
+            c0 = _mm_add_ps(c0, _mm_mul_ps(_mm_loadu_ps(m), wk));
+            c1 = _mm_add_ps(c1, _mm_mul_ps(_mm_loadu_ps(m + 4), wk));
+            c2 = _mm_add_ps(c2, _mm_mul_ps(_mm_loadu_ps(m + 8), wk));
+            c3 = _mm_add_ps(c3, _mm_mul_ps(_mm_loadu_ps(m + 12), wk));
+        }
+#endif
+
+        __m128 p = _mm_loadu_ps(positions_in + v * 4);
+        __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, SKIN_SPLAT(p, 0)), _mm_mul_ps(c1, SKIN_SPLAT(p, 1))),
+                              _mm_add_ps(_mm_mul_ps(c2, SKIN_SPLAT(p, 2)), _mm_mul_ps(c3, SKIN_SPLAT(p, 3))));
+        _mm_storeu_ps(positions_out + v * 4, r);
+
+        if (normals_in){
+            __m128 n = _mm_loadu_ps(normals_in + v * 4);
+            r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, SKIN_SPLAT(n, 0)), _mm_mul_ps(c1, SKIN_SPLAT(n, 1))),
+                           _mm_mul_ps(c2, SKIN_SPLAT(n, 2)));
+            _mm_storeu_ps(normals_out + v * 4, r);
+        }
+    }
+}
+#else
+void Skin::skinRange(const GLfloat* positions_in, const GLfloat* normals_in, const GLint* bones, const GLfloat* weights,
+                     const glm::mat4* palette, GLfloat* positions_out, GLfloat* normals_out, size_t begin, size_t end){
+    skinRangeScalar(positions_in, normals_in, bones, weights, palette, positions_out, normals_out, begin, end);
+}
+#endif
+
+void Skin::benchmark(size_t vertices, size_t bones, int runs){
+    std::vector<GLfloat> positions(vertices * 3), normals(vertices * 3);
+    for (size_t i = 0; i < positions.size(); i++){
+        positions[i] = (float)rand() / RAND_MAX * 2.f - 1.f;
+        normals[i] = (float)rand() / RAND_MAX * 2.f - 1.f;
+    }
+
+    std::vector<GLint> ids(vertices * SKIN_INFLUENCES);
+    std::vector<GLfloat> weights(vertices * SKIN_INFLUENCES);
+    for (size_t v = 0; v < vertices; v++){
+        float left = 1.f;
+        for (int k = 0; k < SKIN_INFLUENCES; k++){
+            ids[v * SKIN_INFLUENCES + k] = rand() % bones;
+            weights[v * SKIN_INFLUENCES + k] = k == SKIN_INFLUENCES - 1 ? left : left * (float)rand() / RAND_MAX;
+            left -= weights[v * SKIN_INFLUENCES + k];
+        }
+    }
+
+    std::vector<glm::mat4> palette(bones);
+    for (size_t b = 0; b < bones; b++)
+        for (int c = 0; c < 4; c++)
+            for (int r = 0; r < 3; r++)
+                palette[b][c][r] = (float)rand() / RAND_MAX;
+
+    Skin skin(positions, normals);
+    skin.setInfluences(ids, weights);
+
+    double start = Profiler::now();
+    for (int i = 0; i < runs; i++)
+        skinRangeScalar(&skin._positions[0], &skin._normals[0], &ids[0], &weights[0], &palette[0],
+                        &skin._skinned_positions[0], &skin._skinned_normals[0], 0, vertices);
+    double scalar = Profiler::now() - start;
+
+    start = Profiler::now();
+    for (int i = 0; i < runs; i++)
+        skinRange(&skin._positions[0], &skin._normals[0], &ids[0], &weights[0], &palette[0],
+                  &skin._skinned_positions[0], &skin._skinned_normals[0], 0, vertices);
+    double simd = Profiler::now() - start;
+
+    start = Profiler::now();
+    for (int i = 0; i < runs; i++)
+        skin.apply(palette);
+    double threaded = Profiler::now() - start;
+
+    double count = (double)vertices * runs * 1000.;
+    std::cout << "Skinning " << vertices << " vertices, " << bones << " bones, " << runs << " runs (vertices/ms):" << std::endl;
+    std::cout << std::setw(28) << "scalar" << std::setw(14) << std::fixed << std::setprecision(0) << count / scalar << std::endl;
+#ifdef __AVX__
+    std::cout << std::setw(28) << "AVX" << std::setw(14) << count / simd << std::endl;
+#elif defined(SKIN_SSE)
+    std::cout << std::setw(28) << "SSE" << std::setw(14) << count / simd << std::endl;
+#endif
+    std::cout << std::setw(28) << "threaded x" + std::to_string(JobSystem::concurrency()) << std::setw(14) << count / threaded << std::endl;
+}
@@ -0,0 +1,67 @@
+#ifndef SKINNING_H
+#define SKINNING_H
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <vector>
+
+#define SKIN_INFLUENCES 4
+
+/**!
+ * \short Bind pose and bone influences of a skinned mesh, kept on the CPU
+ * Positions and normals are padded to 4 floats so that the CPU skinning
+ * kernel works on whole SSE registers. Weights that do not add up to one
+ * are completed with the identity, as in the vertex shader.
+ */
+class Skin {
+    public:
+        enum Mode {
+            GPU,    // gBones palette, blended in the vertex shader
+            CPU     // blended here, streamed to the vertex buffers every draw
+        };
+
+        Skin(const std::vector<GLfloat>& positions, const std::vector<GLfloat>& normals);
+
+        void setInfluences(const std::vector<GLint>& bones, const std::vector<GLfloat>& weights);
+
+        inline size_t size() const { return _positions.size() / 4; }
+        inline bool hasNormals() const { return !_normals.empty(); }
+
+        /**!
+         * \short Blend the bind pose with the palette, split on the job system
+         * Results are read with skinnedPositions and skinnedNormals, 4 floats per vertex.
+         */
+        void apply(const std::vector<glm::mat4>& palette);
+
+        inline const std::vector<GLfloat>& skinnedPositions() const { return _skinned_positions; }
+        inline const std::vector<GLfloat>& skinnedNormals() const { return _skinned_normals; }
+
+        std::vector<GLfloat> bindPositions() const;
+        std::vector<GLfloat> bindNormals() const;
+
+        /**!
+         * \short Skin the vertices [begin, end), with SSE when available
+         * \param normals_in May be null, normals_out is then left untouched
+         */
+        static void skinRange(const GLfloat* positions_in, const GLfloat* normals_in, const GLint* bones, const GLfloat* weights,
+                              const glm::mat4* palette, GLfloat* positions_out, GLfloat* normals_out, size_t begin, size_t end);
+        static void skinRangeScalar(const GLfloat* positions_in, const GLfloat* normals_in, const GLint* bones, const GLfloat* weights,
+                                    const glm::mat4* palette, GLfloat* positions_out, GLfloat* normals_out, size_t begin, size_t end);
+
+        /**!
+         * \short Print skinned vertices per millisecond for the scalar, SIMD and threaded kernels
+         */
+        static void benchmark(size_t vertices = 100000, size_t bones = 64, int runs = 20);
+
+        static Mode MODE;
+        static size_t GRAIN;    // vertices per job
+
+    private:
+        std::vector<GLfloat> _positions, _normals;
+        std::vector<GLint> _bones;
+        std::vector<GLfloat> _weights;
+
+        std::vector<GLfloat> _skinned_positions, _skinned_normals;
+};
+
+#endif
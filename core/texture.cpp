@@ -1,26 +1,45 @@
 #include "texture.hpp"
 #include "common.hpp"
+#include "jobs.hpp"
+#include "profiler.hpp"
+#include "compressed.hpp"
 #include <string.h>
+#include <stdlib.h>
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <vector>
+#include <algorithm>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 
 using namespace std;
 
-map<string, Texture*> Texture::LOADED = map<string, Texture*>();
-
+// Neutral value for each usage: grey albedo, no specular, flat normal, no height
+const unsigned char Texture::PLACEHOLDER[5][4] = {
+    {200, 200, 200, 255}, {0, 0, 0, 255}, {128, 128, 255, 255}, {0, 0, 0, 255}, {0, 0, 0, 255}
+};
 
-uint Texture::LAST_ID = 0;
+double Texture::UPLOAD_BUDGET = 2.;
+bool Texture::PREFER_COMPRESSED = true;
+unsigned Texture::FRAME = 0;
+std::mutex Texture::DECODE_LOCK;
+std::multiset<Texture*> Texture::DECODING;
+std::deque<Texture::Decoded> Texture::DECODED;
+GLuint Texture::PBOS[3] = {0, 0, 0};
+int Texture::PBO_NEXT = 0;
+bool Texture::BINDLESS = false;
+int Texture::QUALITY = 0;
+int Texture::QUALITY_OVERRIDE[5] = {-1, -1, -1, -1, -1};
+GLuint Texture::ACTIVE_UNIT = 0;
+GLuint Texture::BOUND[Texture::UNITS][3] = {};
+Texture* Texture::PLACEHOLDERS[5] = {nullptr, nullptr, nullptr, nullptr, nullptr};
 
 Texture::Texture(Type t):
-    _type(t), _id(LAST_ID++)
+    _target(t == Cube ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D), _type(t), _resident(true), _compressed_format(0),
+    _width(1), _height(1), _levels(1), _format(GL_RGBA), _last_used(FRAME), _dropped(0), _reloading(false), _handle(0)
 {   
-    if (_type == Cube)
-        _id = 0;
-    activate();
 	glGenTextures(1, &_texture_id);     
 }
 
@@ -46,24 +65,126 @@ Texture::Texture(unsigned char* data, int width, int height):
 	// ... which requires mipmaps. Generate them automatically.
 	glGenerateMipmap(GL_TEXTURE_2D);
     unbind();
+    
+    _width = width;
+    _height = height;
+    _format = GL_RGB;
+    while (std::max(width, height) >> _levels)
+        _levels++;
 
 }
 
 Texture::~Texture(){
+    {
+        // A decode still running will see we are gone and drop its image
+        std::lock_guard<std::mutex> lock(DECODE_LOCK);
+        DECODING.erase(this);
+        for (auto it = DECODED.begin(); it != DECODED.end();){
+            if (it->texture == this){
+                _release(*it);
+                it = DECODED.erase(it);
+            } else
+                it++;
+        }
+    }
+    if (_handle)
+        glMakeTextureHandleNonResidentARB(_handle);
+    _forget(_texture_id);
     glDeleteTextures(1, &_texture_id);
 }
 
-void Texture::apply(GLuint framgment_id) {
-    activate();
+void Texture::apply(GLuint unit) {
+    _last_used = FRAME;
+    activeUnit(unit);
     bind();
-    glUniform1i(framgment_id, _id);
 }
 
-
-void Texture::deapply(GLuint framgment_id) {
-    deactivate();
+void Texture::deapply(GLuint unit) {
+    activeUnit(unit);
     unbind();
-    glUniform1i(framgment_id, 0);
+}
+
+void Texture::activeUnit(GLuint unit){
+    if (unit == ACTIVE_UNIT)
+        return;
+    glActiveTexture(GL_TEXTURE0 + unit);
+    ACTIVE_UNIT = unit;
+}
+
+void Texture::bindTexture(GLenum target, GLuint id){
+    GLuint& bound = BOUND[ACTIVE_UNIT][_targetIndex(target)];
+    if (bound == id)
+        return;
+    glBindTexture(target, id);
+    bound = id;
+}
+
+int Texture::_targetIndex(GLenum target){
+    return target == GL_TEXTURE_2D_ARRAY ? 1 : target == GL_TEXTURE_CUBE_MAP ? 2 : 0;
+}
+
+void Texture::_forget(GLuint id){
+    // Deleting a texture unbinds it from every unit
+    for (GLuint u = 0; u < UNITS; u++)
+        for (int t = 0; t < 3; t++)
+            if (BOUND[u][t] == id)
+                BOUND[u][t] = 0;
+}
+
+bool Texture::bindless(){
+    return BINDLESS && GLEW_ARB_bindless_texture;
+}
+
+GLuint64 Texture::handle(){
+    if (_target != GL_TEXTURE_2D)
+        return 0;
+    if (!_resident)
+        return _placeholder(_type)->handle();
+    
+    _last_used = FRAME;
+    if (!_handle){
+        _handle = glGetTextureHandleARB(_texture_id);
+        glMakeTextureHandleResidentARB(_handle);
+        GL_CHECK("Texture::handle");
+    }
+    return _handle;
+}
+
+Texture* Texture::_placeholder(Type t){
+    // Shared 1x1 textures, their handles stand in for textures still decoding
+    if (!PLACEHOLDERS[t]){
+        PLACEHOLDERS[t] = new Texture(t);
+        PLACEHOLDERS[t]->activate();
+        PLACEHOLDERS[t]->bind();
+        if (t == Cube)
+            for (int f = 0; f < 6; f++)
+                glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + f, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, PLACEHOLDER[t]);
+        else
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, PLACEHOLDER[t]);
+        glTexParameteri(PLACEHOLDERS[t]->_target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        PLACEHOLDERS[t]->unbind();
+    }
+    return PLACEHOLDERS[t];
+}
+
+void Texture::_recreate(){
+    if (_handle)
+        glMakeTextureHandleNonResidentARB(_handle);
+    _handle = 0;
+    _forget(_texture_id);
+    glDeleteTextures(1, &_texture_id);
+    glGenTextures(1, &_texture_id);
+}
+
+
+size_t Texture::bytes() const {
+    size_t total = 0;
+    for (int l = 0; l < _levels; l++){
+        int w = std::max(1, _width >> l), h = std::max(1, _height >> l);
+        // Drivers keep RGB as RGBA
+        total += _compressed_format ? CompressedImage::levelBytes(_compressed_format, w, h) : (size_t)w * h * (_format == GL_RGB ? 4 : _bytesPerPixel(_format));
+    }
+    return _type == Cube ? total * 6 : total;
 }
 
 unsigned char* Texture::getDataFromFile(std::string path, GLenum*format, int *width, int *height) {
@@ -78,6 +199,9 @@ unsigned char* Texture::getDataFromFile(std::string path, GLenum*format, int *wi
         case 1:
             *format = GL_RED;
             break;
+        case 2:
+            *format = GL_RG;
+            break;
         case 3:
             *format = GL_RGB;
             break;
@@ -97,117 +221,494 @@ unsigned char* Texture::getDataFromFile(std::string path, GLenum*format, int *wi
 
 
 
+std::vector<std::string> Texture::_cubemapFaces(std::string directory){
+    // In GL_TEXTURE_CUBE_MAP_POSITIVE_X + i order, which is also the DDS one
+    return {directory + RIGHT_TEX, directory + LEFT_TEX, directory + TOP_TEX, directory + BOTTOM_TEX, directory + BACK_TEX, directory + FRONT_TEX};
+}
+
 Texture* Texture::getCubemapTexture(std::string directory, bool gamma) {
+    PROFILE_SCOPE("Texture::getCubemapTexture");
 
 	Texture* t = new Texture(Cube);
-
-	int width, height;
-	GLenum format;
-	unsigned char*data;
-
-
 	std::string final_path = "textures/"+directory+"/";
     
     t->activate();
 	t->bind();
 	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
     
-    Debug::CheckOpenGLError("Texture::getCubemapTexture");
+    GL_CHECK("Texture::getCubemapTexture");
     
-	//load sides
-	data = Texture::getDataFromFile(final_path+TOP_TEX,  &format,&width, &height);
-	glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_Y, 0,GL_RGB, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-	width = 0;
-	height = 0;
-	data = nullptr;
-
-    data = Texture::getDataFromFile(final_path+BOTTOM_TEX,  &format,&width, &height);
-	glTexImage2D(GL_TEXTURE_CUBE_MAP_NEGATIVE_Y, 0,GL_RGB, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-	width = 0;
-	height = 0;
-	data = nullptr;
-
-
-	data = Texture::getDataFromFile(final_path+LEFT_TEX , &format, &width, &height);
-	glTexImage2D(GL_TEXTURE_CUBE_MAP_NEGATIVE_X, 0,GL_RGB, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-	width = 0;
-	height = 0;
-	data = nullptr;
-
-	data = Texture::getDataFromFile( final_path+RIGHT_TEX, &format,&width, &height);
-	glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X, 0,GL_RGB, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-	width = 0;
-	height = 0;
-	data = nullptr;
-
-	data = Texture::getDataFromFile( final_path+BACK_TEX, &format,&width, &height);
-	glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_Z, 0,GL_RGB, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-	width = 0;
-	height = 0;
-	data = nullptr;
-
-
-	data = Texture::getDataFromFile(final_path+FRONT_TEX, &format,&width, &height);
-	glTexImage2D(GL_TEXTURE_CUBE_MAP_NEGATIVE_Z, 0,GL_RGB, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-	width = 0;
-	height = 0;
-
-	// OpenGL has now copied the data. Free our own version
-	
+    // Baked by --bake-cubemap: a single file read, the mip chain comes with it
+    CompressedImage baked;
+    GLenum format;
+    std::string baked_path = final_path + CUBEMAP_DDS;
+    if (PREFER_COMPRESSED && CompressedImage::readFormat(baked_path, &format) && CompressedImage::supported(format)
+        && CompressedImage::load(baked_path, baked) && baked.faces == 6){
+        int mips = baked.mipCount();
+        int skip = std::min(droppedMips(Cube), mips - 1);
+        for (int f = 0; f < 6; f++){
+            for (int l = skip; l < mips; l++){
+                const CompressedImage::Level& level = baked.levels[f * mips + l];
+                glCompressedTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + f, l - skip, baked.format, level.width, level.height, 0, level.data.size(), &level.data[0]);
+            }
+        }
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, mips - skip - 1);
+        t->_width = baked.levels[skip].width;
+        t->_height = baked.levels[skip].height;
+        t->_levels = mips - skip;
+        t->_format = t->_compressed_format = baked.format;
+    } else {
+        std::vector<Decoded> faces = _decodeAll(t, _cubemapFaces(final_path));
+        
+        // Faces have to share a size and a format, a missing one is left black rather than making the cube map incomplete
+        GLenum format = GL_RGB;
+        for (const Decoded& d: faces){
+            if (d.data){
+                t->_width = d.width;
+                t->_height = d.height;
+                format = d.format;
+                break;
+            }
+        }
+        for (int f = 0; f < 6; f++){
+            const Decoded& d = faces[f];
+            bool fits = d.data && d.width == t->_width && d.height == t->_height && d.format == format;
+            if (!d.data){
+                DEBUG(Debug::Error, "Cannot load cube map face %s\n", _cubemapFaces(final_path)[f].c_str());
+            } else if (!fits){
+                DEBUG(Debug::Error, "Cube map face %s is %dx%d, not %dx%d like the others or not in their format\n",
+                      _cubemapFaces(final_path)[f].c_str(), d.width, d.height, t->_width, t->_height);
+            }
+            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + f, 0, GL_RGB, t->_width, t->_height, 0, format, GL_UNSIGNED_BYTE, fits ? d.data : nullptr);
+            // OpenGL has now copied the data. Free our own version
+            _release(faces[f]);
+        }
+        t->_format = GL_RGB;
+        glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
+        for (t->_levels = 1; std::max(t->_width, t->_height) >> t->_levels; t->_levels++);
+    }
 
 	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-
-	
-	
-	glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
 	t->unbind();
+    GL_CHECK("Texture::getCubemapTexture");
 
 	return t;
 };
 
+bool Texture::bakeCubemap(std::string directory){
+    std::string final_path = "textures/" + directory + "/";
+    std::vector<std::string> paths = _cubemapFaces(final_path);
+    std::vector<CompressedImage> faces(6);
+    
+    JobSystem::parallelFor(6, 1, [&](size_t begin, size_t end){
+        for (size_t f = begin; f < end; f++){
+            int width, height, components;
+            unsigned char* data = stbi_load(paths[f].c_str(), &width, &height, &components, 4);
+            if (!data)
+                continue;
+            faces[f] = CompressedImage::encode(data, width, height, GL_COMPRESSED_RGB_S3TC_DXT1_EXT);
+            stbi_image_free(data);
+        }
+    });
+    
+    CompressedImage baked;
+    baked.format = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+    baked.faces = 6;
+    for (int f = 0; f < 6; f++){
+        if (faces[f].levels.empty() || faces[f].levels[0].width != faces[0].levels[0].width || faces[f].levels[0].height != faces[0].levels[0].height){
+            DEBUG(Debug::Error, "Cannot bake %s, faces missing or of different sizes\n", paths[f].c_str());
+            return false;
+        }
+        baked.levels.insert(baked.levels.end(), faces[f].levels.begin(), faces[f].levels.end());
+    }
+    
+    if (!baked.saveDDS(final_path + CUBEMAP_DDS)){
+        DEBUG(Debug::Error, "Cannot write %s\n", (final_path + CUBEMAP_DDS).c_str());
+        return false;
+    }
+    std::cout << final_path + CUBEMAP_DDS << ": " << baked.size() / 1024 << " KiB" << std::endl;
+    return true;
+}
+
 Texture* Texture::fromFile(std::string filename, std::string directory, Type type)
 {
     if (!directory.empty())
         filename = directory + '/' + filename;
     
-    Texture* t = nullptr;
+    // Prebuilt mip chains from the offline converter, see --convert-textures
+    GLenum compressed = 0;
+    std::string candidate = filename.substr(0, filename.rfind('.')) + ".dds";
+    if (CompressedImage::isCompressedPath(filename))
+        candidate = filename;
+    if (PREFER_COMPRESSED || candidate == filename){
+        if (CompressedImage::readFormat(candidate, &compressed) && CompressedImage::supported(compressed))
+            filename = candidate;
+        else
+            compressed = 0;
+    }
+    
+    // Checked here so that a missing file still returns nullptr
+    if (!std::ifstream(filename).good())
+        return nullptr;
+
+    Texture* t = new Texture(type);
+    t->_path = filename;
+    t->_resident = false;
+    t->_compressed_format = compressed;
+    t->activate();
+    t->bind();
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, PLACEHOLDER[type]);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    t->unbind();
+    
+    _queueDecode(t, filename, compressed, -1);
+    return t;
+}
 
-    int width, height, nrComponents;
-    unsigned char *data = stbi_load(filename.c_str(), &width, &height, &nrComponents, 0);
+void Texture::_queueDecode(Texture* t, std::string filename, GLenum compressed, int layer){
+    {
+        std::lock_guard<std::mutex> lock(DECODE_LOCK);
+        DECODING.insert(t);
+    }
     
-    if (data){
-        GLenum format;
+    int drop = droppedMips(t->_type);
+    JobSystem::submit([t, filename, compressed, layer, drop](){
+        Decoded d = _decode(t, filename, compressed, layer, drop);
         
-        switch (nrComponents){
-        case 1:
-            format = GL_RED;
-            break;
-        case 3:
-            format = GL_RGB;
-            break;
-        case 4:
-            format = GL_RGBA;
-            break;
+        std::lock_guard<std::mutex> lock(DECODE_LOCK);
+        auto it = DECODING.find(t);
+        if (it == DECODING.end()){
+            _release(d);
+            return;
+        }
+        DECODING.erase(it);
+        if (!d.data && !d.image)
+            DEBUG(Debug::Error, "Cannot decode texture %s\n", filename.c_str());
+        DECODED.push_back(d);
+    });
+}
+
+int Texture::droppedMips(Type t){
+    return QUALITY_OVERRIDE[t] >= 0 ? QUALITY_OVERRIDE[t] : QUALITY;
+}
+
+int Texture::_tier(std::string name){
+    if (name == "high")
+        return 0;
+    if (name == "medium")
+        return 1;
+    if (name == "low")
+        return 2;
+    if (!name.empty() && name.find_first_not_of("0123456789") == std::string::npos)
+        return atoi(name.c_str());
+    return -1;
+}
+
+bool Texture::parseQuality(std::string setting){
+    static const char* TYPES[5] = {"diffuse", "specular", "normal", "height", "cube"};
+    
+    std::stringstream stream(setting);
+    std::string item;
+    while (std::getline(stream, item, ',')){
+        size_t equal = item.find('=');
+        int tier = _tier(equal == std::string::npos ? item : item.substr(equal + 1));
+        if (tier < 0){
+            DEBUG(Debug::Error, "Unknown texture quality %s\n", item.c_str());
+            return false;
+        }
+        if (equal == std::string::npos){
+            QUALITY = tier;
+            continue;
         }
-        t = new Texture(type);
-        t->activate();
-        t->bind();
         
-        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D);
+        std::string type = item.substr(0, equal);
+        int t = std::find(TYPES, TYPES + 5, type) - TYPES;
+        if (t == 5){
+            DEBUG(Debug::Error, "Unknown texture type %s\n", type.c_str());
+            return false;
+        }
+        QUALITY_OVERRIDE[t] = tier;
+    }
+    return true;
+}
 
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        t->unbind();
+unsigned char* Texture::_downsample(unsigned char* data, int* width, int* height, int components, int times){
+    for (; times > 0 && (*width > 1 || *height > 1); times--){
+        int w = std::max(1, *width / 2), h = std::max(1, *height / 2);
+        unsigned char* half = (unsigned char*)malloc((size_t)w * h * components);
+        
+        // Average of the 2x2 footprint, clamped at the border of odd sizes
+        for (int y = 0; y < h; y++){
+            int y0 = std::min(2 * y, *height - 1), y1 = std::min(2 * y + 1, *height - 1);
+            for (int x = 0; x < w; x++){
+                int x0 = std::min(2 * x, *width - 1), x1 = std::min(2 * x + 1, *width - 1);
+                for (int c = 0; c < components; c++){
+                    int sum = data[((size_t)y0 * *width + x0) * components + c] + data[((size_t)y0 * *width + x1) * components + c]
+                            + data[((size_t)y1 * *width + x0) * components + c] + data[((size_t)y1 * *width + x1) * components + c];
+                    half[((size_t)y * w + x) * components + c] = (sum + 2) / 4;
+                }
+            }
+        }
+        stbi_image_free(data);
+        data = half;
+        *width = w;
+        *height = h;
     }
+    return data;
+}
+
+Texture::Decoded Texture::_decode(Texture* t, std::string filename, GLenum compressed, int layer, int drop){
+    Decoded d;
+    int nrComponents = 0;
+    d.texture = t;
+    d.data = nullptr;
+    d.image = nullptr;
+    d.width = d.height = 0;
+    d.layer = layer;
+    if (compressed){
+        d.image = new CompressedImage;
+        if (!CompressedImage::load(filename, *d.image)){
+            delete d.image;
+            d.image = nullptr;
+        }
+        // The levels we do not want are already in the file, just skip them
+        if (d.image && drop > 0){
+            int mips = d.image->mipCount();
+            int skip = std::min(drop, mips - 1);
+            std::vector<CompressedImage::Level> kept;
+            for (int f = 0; f < d.image->faces; f++)
+                kept.insert(kept.end(), d.image->levels.begin() + f * mips + skip, d.image->levels.begin() + (f + 1) * mips);
+            d.image->levels.swap(kept);
+        }
+    } else {
+        d.data = stbi_load(filename.c_str(), &d.width, &d.height, &nrComponents, 0);
+        if (d.data && drop > 0)
+            d.data = _downsample(d.data, &d.width, &d.height, nrComponents, drop);
+    }
+    switch (nrComponents){
+    case 1:
+        d.format = GL_RED;
+        break;
+    case 2:
+        d.format = GL_RG;
+        break;
+    case 4:
+        d.format = GL_RGBA;
+        break;
+    default:
+        d.format = GL_RGB;
+    }
+    return d;
+}
+
+std::vector<Texture::Decoded> Texture::_decodeAll(Texture* t, const std::vector<std::string>& paths){
+    std::vector<Decoded> decoded(paths.size());
+    int drop = droppedMips(t->_type);
+    
+    // One image per job, waiting for all of them costs the slowest decode rather than their sum
+    JobSystem::parallelFor(paths.size(), 1, [&](size_t begin, size_t end){
+        for (size_t i = begin; i < end; i++)
+            decoded[i] = _decode(t, paths[i], 0, i, drop);
+    });
+    return decoded;
+}
+
+void Texture::_release(Decoded& d){
+    stbi_image_free(d.data);
+    delete d.image;
+    d.data = nullptr;
+    d.image = nullptr;
+}
+
+int Texture::_bytesPerPixel(GLenum format){
+    switch (format){
+    case GL_RED:
+        return 1;
+    case GL_RG:
+        return 2;
+    case GL_RGB:
+        return 3;
+    default:
+        return 4;
+    }
+}
+
+bool Texture::_stage(const Decoded& d){
+    size_t size = d.image ? d.image->size() : (size_t)d.width * d.height * _bytesPerPixel(d.format);
+    
+    // Round robin over a few PBOs so that refilling one does not wait for the driver to be done reading the previous image.
+    // The texture calls that follow still run right away, so this only saves the driver's own copy of the pixels.
+    if (!PBOS[0])
+        glGenBuffers(3, PBOS);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, PBOS[PBO_NEXT]);
+    PBO_NEXT = (PBO_NEXT + 1) % 3;
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+    void* mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (mapped){
+        if (d.image){
+            size_t offset = 0;
+            for (const CompressedImage::Level& l: d.image->levels){
+                memcpy((char*)mapped + offset, &l.data[0], l.data.size());
+                offset += l.data.size();
+            }
+        } else
+            memcpy(mapped, d.data, size);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    }
+    else
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    return mapped != nullptr;
+}
+
+void Texture::_upload(const Decoded& d){
+    // Failed decodes keep their placeholder, or the levels left after eviction
+    if (!d.data && !d.image){
+        _reloading = false;
+        return;
+    }
+    if (_handle)
+        _recreate();
+    
+    bool mapped = _stage(d);
+    activate();
+    bind();
+    
+    if (d.image){
+        // The mip chain comes with the file, nothing to generate
+        size_t offset = 0;
+        for (int l = 0; l < d.image->mipCount(); l++){
+            const CompressedImage::Level& level = d.image->levels[l];
+            glCompressedTexImage2D(GL_TEXTURE_2D, l, d.image->format, level.width, level.height, 0, level.data.size(),
+                                   mapped ? (void*)offset : (void*)&level.data[0]);
+            offset += level.data.size();
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, d.image->mipCount() - 1);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, d.image->mipCount() > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+        unbind();
+        GL_CHECK("Texture::upload");
+        _width = d.image->levels[0].width;
+        _height = d.image->levels[0].height;
+        _levels = d.image->mipCount();
+        _format = d.image->format;
+        _resident = true;
+        _dropped = 0;
+        _reloading = false;
+        return;
+    }
+    
+    if (mapped)
+        glTexImage2D(GL_TEXTURE_2D, 0, d.format, d.width, d.height, 0, d.format, GL_UNSIGNED_BYTE, nullptr);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    if (!mapped)
+        glTexImage2D(GL_TEXTURE_2D, 0, d.format, d.width, d.height, 0, d.format, GL_UNSIGNED_BYTE, d.data);
+    _width = d.width;
+    _height = d.height;
+    _format = d.format;
+    for (_levels = 1; std::max(_width, _height) >> _levels; _levels++);
+    // Set before generating, a texture that had levels dropped had its chain shortened
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, _levels - 1);
+    glGenerateMipmap(GL_TEXTURE_2D);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    unbind();
+    GL_CHECK("Texture::upload");
+    
+    _resident = true;
+    _dropped = 0;
+    _reloading = false;
+}
+
+bool Texture::_dropTopMip(){
+    if (_target != GL_TEXTURE_2D || !_resident || _reloading || _levels < 2)
+        return false;
+    
+    // Read the smaller levels back, they become the whole chain of a new texture object
+    std::vector<std::vector<unsigned char>> levels(_levels - 1);
+    activate();
+    bind();
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    for (int l = 1; l < _levels; l++){
+        int w = std::max(1, _width >> l), h = std::max(1, _height >> l);
+        std::vector<unsigned char>& level = levels[l - 1];
+        if (_compressed_format){
+            level.resize(CompressedImage::levelBytes(_compressed_format, w, h));
+            glGetCompressedTexImage(GL_TEXTURE_2D, l, &level[0]);
+        } else {
+            level.resize((size_t)w * h * _bytesPerPixel(_format));
+            glGetTexImage(GL_TEXTURE_2D, l, _format, GL_UNSIGNED_BYTE, &level[0]);
+        }
+    }
+    unbind();
+    _recreate();
+    
+    _width = std::max(1, _width >> 1);
+    _height = std::max(1, _height >> 1);
+    _levels--;
+    _dropped++;
+    
+    bind();
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for (int l = 0; l < _levels; l++){
+        int w = std::max(1, _width >> l), h = std::max(1, _height >> l);
+        if (_compressed_format)
+            glCompressedTexImage2D(GL_TEXTURE_2D, l, _compressed_format, w, h, 0, levels[l].size(), &levels[l][0]);
+        else
+            glTexImage2D(GL_TEXTURE_2D, l, _format, w, h, 0, _format, GL_UNSIGNED_BYTE, &levels[l][0]);
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, _levels - 1);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, _levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    unbind();
+    GL_CHECK("Texture::dropTopMip");
+    return true;
+}
+
+void Texture::_reload(){
+    if (_reloading || _path.empty())
+        return;
+    _reloading = true;
+    _queueDecode(this, _path, _compressed_format, -1);
+}
+
+int Texture::processUploads(double budget_ms){
+    PROFILE_SCOPE("Texture::processUploads");
+    
+    double start = Profiler::now();
+    int uploaded = 0;
+    do {
+        Decoded d;
+        {
+            std::lock_guard<std::mutex> lock(DECODE_LOCK);
+            if (DECODED.empty())
+                break;
+            d = DECODED.front();
+            DECODED.pop_front();
+        }
         
-    stbi_image_free(data);
+        if (d.data || d.image)
+            uploaded++;
+        d.texture->_upload(d);
+        _release(d);
+    } while (Profiler::now() - start < budget_ms * 1000.);
+    
+    if (uploaded)
+        DEBUG(Debug::Info, "%d textures uploaded in %.2f ms, %d pending\n", uploaded, (Profiler::now() - start) / 1000., (int)pendingUploads());
+    return uploaded;
+}
 
-    return t;
+size_t Texture::pendingUploads(){
+    std::lock_guard<std::mutex> lock(DECODE_LOCK);
+    return DECODING.size() + DECODED.size();
 }
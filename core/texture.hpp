@@ -4,6 +4,10 @@
 
 #include <string>
 #include <map>
+#include <set>
+#include <deque>
+#include <vector>
+#include <mutex>
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h> 
@@ -18,9 +22,14 @@
 #define RIGHT_TEX "back.bmp"
 #define FRONT_TEX "right.bmp"
 #define BACK_TEX "left.bmp"
+#define CUBEMAP_DDS "cubemap.dds" // the six faces baked by --bake-cubemap
+
+class CompressedImage;
+class TextureCache;
 
 
 class Texture {
+    friend class TextureCache;
     public:
         enum Type {Diffuse, Specular, Normal, Height, Cube};
     
@@ -36,35 +45,211 @@ class Texture {
          * \short Create an empty texture of type \ref Type
          */
         Texture(Type t = Diffuse);
-        ~Texture();
+        virtual ~Texture();
         
         inline GLuint id() const { return _texture_id; }
-        inline GLuint texId() const {return _id;}
         inline Type type() const { return _type; }
+        inline bool resident() const { return _resident; }
+        
+        /**!
+         * \short Block compression format of the file, 0 for plain images
+         */
+        inline GLenum compressedFormat() const { return _compressed_format; }
         inline void type(Type t) { _type = t; }
-        inline void bind() { glBindTexture((_type == Cube ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D), _texture_id); }
-        inline void unbind() { glBindTexture((_type == Cube ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D), 0); }
+        inline std::string path() const { return _path; }
+        inline int width() const { return _width; }
+        inline int height() const { return _height; }
+        inline int levels() const { return _levels; }
+        
+        /**!
+         * \short GL_RED, GL_RG, GL_RGB, GL_RGBA or the block compression format of the storage
+         */
+        inline GLenum format() const { return _format; }
+        
+        /**!
+         * \short Estimate of the video memory taken by the whole mip chain
+         */
+        virtual size_t bytes() const;
+        inline void bind() { bindTexture(_target, _texture_id); }
+        inline void unbind() { bindTexture(_target, 0); }
         
-        inline void activate() {  glActiveTexture(GL_TEXTURE0 + _id); }
-        inline void deactivate() {  glActiveTexture(GL_TEXTURE0); }
-        void apply(GLuint framgment_id);
-        void deapply(GLuint framgment_id);
+        /**!
+         * \short Select the unit kept for uploads and edits, so that they never disturb what draws sample
+         */
+        inline void activate() { activeUnit(EDIT_UNIT); }
+        inline void deactivate() { activeUnit(0); }
+        
+        /**!
+         * \short Bind to a texture unit for the next draws, nothing is sent to GL when it already is
+         */
+        void apply(GLuint unit);
+        void deapply(GLuint unit);
         
+        /**!
+         * \short Resident ARB_bindless_texture handle, the one of a placeholder until the image is uploaded
+         * Only for 2D textures; arrays and cube maps keep using texture units.
+         */
+        GLuint64 handle();
+        
+        /**!
+         * \short glActiveTexture and glBindTexture skipping calls that would not change the bindings
+         * All texture binding goes through these so that the shadow state stays right.
+         */
+        static void activeUnit(GLuint unit);
+        static void bindTexture(GLenum target, GLuint id);
+        
+        /**!
+         * \short Whether materials pass bindless handles instead of binding units
+         */
+        static bool bindless();
+        
+        /**!
+         * \short Cube map out of the six face images of a skybox folder, decoded in parallel
+         * A \ref CUBEMAP_DDS in the folder is used instead when compressed textures are preferred.
+         */
         static Texture* getCubemapTexture(std::string directory, bool gamma);
+        
+        /**!
+         * \short Compress the six faces of a skybox folder into a single \ref CUBEMAP_DDS, offline
+         */
+        static bool bakeCubemap(std::string directory);
+        
+        /**!
+         * \short Create a texture showing a 1x1 placeholder, decoded on a worker thread
+         * Returns nullptr right away when the file cannot be opened. The image
+         * replaces the placeholder once \ref processUploads picked it up.
+         * A .dds next to the requested file is preferred when the GPU can sample it.
+         */
         static Texture* fromFile(std::string filename, std::string directory = "", Type t = Type::Diffuse);
+        
+        /**!
+         * \short Upload decoded images through pixel buffer objects, from the GL thread
+         * Each upload, mipmap generation included, completes within the call: the budget is what keeps frames smooth.
+         * \param budget_ms Stop once that much time was spent, at least one image is uploaded
+         * \return Number of textures made resident
+         */
+        static int processUploads(double budget_ms);
+        
+        /**!
+         * \short Number of textures still decoding or waiting for upload
+         */
+        static size_t pendingUploads();
 
         static unsigned char* getDataFromFile(std::string path, GLenum*format, int *width, int *height);
+        
+        /**!
+         * \short Top mip levels skipped at load for textures of that type
+         * Images are resampled on the decoding thread, files with a mip chain start further down it.
+         */
+        static int droppedMips(Type t);
+        
+        /**!
+         * \short Set the quality from a tier and per type overrides, e.g. "low,diffuse=high"
+         * Tiers are high, medium and low, or a number of mip levels to drop.
+         */
+        static bool parseQuality(std::string setting);
 
 
-        static std::map<std::string, Texture*> LOADED;
-    private:              
-        static uint LAST_ID;
+        static double UPLOAD_BUDGET;    // milliseconds per frame
+        static bool PREFER_COMPRESSED;
+        static unsigned FRAME;          // advanced by TextureCache::update, stamps the last use of each texture
+        static bool BINDLESS;           // use ARB_bindless_texture when the driver has it
+        static int QUALITY;             // top mip levels dropped at load
+        static int QUALITY_OVERRIDE[5]; // per Type, -1 to follow QUALITY
+        
+        static const GLuint UNITS = 16;             // fragment units guaranteed by GL 3.3
+        static const GLuint EDIT_UNIT = UNITS - 1;  // never assigned to a sampler slot
+    protected:              
+        struct Decoded {
+            Texture* texture;
+            unsigned char* data;
+            CompressedImage* image;     // instead of data for .dds and .ktx files
+            int width, height;
+            GLenum format;
+            int layer;                  // for texture arrays, -1 otherwise
+        };
+        
+        static void _queueDecode(Texture* t, std::string filename, GLenum compressed, int layer);
+        static int _tier(std::string name);
+        
+        /**!
+         * \short Read and decode a file, from any thread
+         */
+        static Decoded _decode(Texture* t, std::string filename, GLenum compressed, int layer, int drop);
+        
+        /**!
+         * \short Halve an image that many times with a box filter, the result is freed like stb_image data
+         */
+        static unsigned char* _downsample(unsigned char* data, int* width, int* height, int components, int times);
+        
+        /**!
+         * \short Decode several images at once on the job system and wait for them, layer set to the index
+         */
+        static std::vector<Decoded> _decodeAll(Texture* t, const std::vector<std::string>& paths);
+        static std::vector<std::string> _cubemapFaces(std::string directory);
+        
+        /**!
+         * \short Bytes per pixel of an uncompressed image as decoded, before any driver padding
+         */
+        static int _bytesPerPixel(GLenum format);
         
-        uint _id;
+        /**!
+         * \short Copy the decoded pixels into the next PBO, left bound when true is returned
+         */
+        static bool _stage(const Decoded& d);
+        virtual void _upload(const Decoded& d);
+        static void _release(Decoded& d);
+        
+        /**!
+         * \short Replace the storage by its mip chain without the top level, for TextureCache
+         * The smaller levels are read back, so this stalls on the GPU; only done under memory pressure.
+         */
+        bool _dropTopMip();
+        
+        /**!
+         * \short Decode the file again to get back the levels dropped by \ref _dropTopMip
+         */
+        void _reload();
+        
+        /**!
+         * \short Swap the GL texture object for a new one, when the storage has to be specified again
+         * A texture with a bindless handle cannot change anymore.
+         */
+        void _recreate();
+        
+        static Texture* _placeholder(Type t);
+        
+        /**!
+         * \short Clear the shadow bindings of a deleted GL texture
+         */
+        static void _forget(GLuint id);
+        static int _targetIndex(GLenum target);
+        
+        static const unsigned char PLACEHOLDER[5][4];   // RGBA shown until the image is resident, per Type
+        
+        static std::mutex DECODE_LOCK;
+        static std::multiset<Texture*> DECODING;    // one entry per decode in flight, guarded by DECODE_LOCK
+        static std::deque<Decoded> DECODED;     // guarded by DECODE_LOCK
+        static GLuint PBOS[3];
+        static int PBO_NEXT;
+        
+        static GLuint ACTIVE_UNIT;
+        static GLuint BOUND[UNITS][3];     // texture bound to each unit, for 2D, 2D array and cube map targets
+        static Texture* PLACEHOLDERS[5];   // per Type, made on first use
         
         GLuint _texture_id;
+        GLenum _target;
         Type _type;
+        bool _resident;
+        GLenum _compressed_format;
         std::string _path;
+        
+        int _width, _height, _levels;
+        GLenum _format;
+        unsigned _last_used;    // FRAME of the last apply
+        int _dropped;           // top levels given up under memory pressure
+        bool _reloading;
+        GLuint64 _handle;
 };
 
 #endif
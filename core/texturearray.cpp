@@ -0,0 +1,186 @@
+#include "texturearray.hpp"
+#include "compressed.hpp"
+#include "material.hpp"
+#include "texturecache.hpp"
+#include "common.hpp"
+
+#include <tuple>
+#include <algorithm>
+
+#include <stb_image.h>
+
+TextureArray::TextureArray(Type t, int width, int height, GLenum format, int layers):
+    Texture(t), _layers(layers), _pending(layers)
+{
+    _width = width;
+    _height = height;
+    _format = format;
+    bool compressed = format != GL_RED && format != GL_RG && format != GL_RGB && format != GL_RGBA;
+    _target = GL_TEXTURE_2D_ARRAY;
+    _resident = false;
+    _compressed_format = compressed ? format : 0;
+    while (std::max(width, height) >> _levels)
+        _levels++;
+    _loaded_levels = _levels;
+
+    activate();
+    bind();
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for (int l = 0; l < _levels; l++){
+        int w = std::max(1, width >> l), h = std::max(1, height >> l);
+        if (compressed)
+            glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, l, format, w, h, layers, 0, CompressedImage::levelBytes(format, w, h) * layers, nullptr);
+        else
+            glTexImage3D(GL_TEXTURE_2D_ARRAY, l, format, w, h, layers, 0, format, GL_UNSIGNED_BYTE, nullptr);
+    }
+
+    // Only the 1x1 level is filled for now, and is the only one sampled until every layer is uploaded
+    int last = _levels - 1;
+    if (compressed){
+        std::vector<unsigned char> block = CompressedImage::encode(PLACEHOLDER[t], 1, 1, format).levels[0].data;
+        std::vector<unsigned char> placeholder;
+        for (int i = 0; i < layers; i++)
+            placeholder.insert(placeholder.end(), block.begin(), block.end());
+        glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, last, 0, 0, 0, 1, 1, layers, format, placeholder.size(), &placeholder[0]);
+    } else {
+        std::vector<unsigned char> placeholder;
+        for (int i = 0; i < layers; i++)
+            placeholder.insert(placeholder.end(), PLACEHOLDER[t], PLACEHOLDER[t] + 4);
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, last, 0, 0, 0, 1, 1, layers, GL_RGBA, GL_UNSIGNED_BYTE, &placeholder[0]);
+    }
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, last);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, last);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    unbind();
+    GL_CHECK("TextureArray::TextureArray");
+}
+
+void TextureArray::load(int layer, std::string path){
+    _queueDecode(this, path, _compressed_format, layer);
+}
+
+size_t TextureArray::bytes() const {
+    return Texture::bytes() * _layers;
+}
+
+void TextureArray::_fillPlaceholder(int layer){
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    std::vector<unsigned char> block;
+    if (_compressed_format)
+        block = CompressedImage::encode(PLACEHOLDER[_type], 1, 1, _compressed_format).levels[0].data;
+    for (int l = 0; l < _levels; l++){
+        int w = std::max(1, _width >> l), h = std::max(1, _height >> l);
+        std::vector<unsigned char> pixels;
+        if (_compressed_format){
+            // The placeholder block is a single color, repeated over the whole level
+            size_t blocks = CompressedImage::levelBytes(_compressed_format, w, h) / block.size();
+            for (size_t b = 0; b < blocks; b++)
+                pixels.insert(pixels.end(), block.begin(), block.end());
+            glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, l, 0, 0, layer, w, h, 1, _compressed_format, pixels.size(), &pixels[0]);
+        } else {
+            for (int p = 0; p < w * h; p++)
+                pixels.insert(pixels.end(), PLACEHOLDER[_type], PLACEHOLDER[_type] + 4);
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, l, 0, 0, layer, w, h, 1, GL_RGBA, GL_UNSIGNED_BYTE, &pixels[0]);
+        }
+    }
+}
+
+void TextureArray::_upload(const Decoded& d){
+    bool compressed = _compressed_format != 0;
+    bool matches = d.image ? d.image->format == _format && d.image->levels[0].width == _width && d.image->levels[0].height == _height
+                           : d.data && d.format == _format && d.width == _width && d.height == _height;
+
+    if (matches){
+        bool mapped = _stage(d);
+        activate();
+        bind();
+        if (d.image){
+            int levels = std::min<int>(d.image->levels.size(), _levels);
+            size_t offset = 0;
+            for (int l = 0; l < levels; l++){
+                const CompressedImage::Level& level = d.image->levels[l];
+                glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, l, 0, 0, d.layer, level.width, level.height, 1, _format, level.data.size(),
+                                          mapped ? (void*)offset : (void*)&level.data[0]);
+                offset += level.data.size();
+            }
+            _loaded_levels = std::min(_loaded_levels, levels);
+        } else
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, d.layer, _width, _height, 1, _format, GL_UNSIGNED_BYTE, mapped ? nullptr : d.data);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    } else {
+        activate();
+        bind();
+        if (d.data || d.image)
+            DEBUG(Debug::Error, "Layer %d does not match its %dx%d texture array\n", d.layer, _width, _height);
+        _fillPlaceholder(d.layer);
+    }
+
+    if (--_pending == 0){
+        if (!compressed)
+            glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, 0);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, (compressed ? _loaded_levels : _levels) - 1);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        _resident = true;
+    }
+    unbind();
+    GL_CHECK("TextureArray::upload");
+}
+
+std::vector<TextureArray*> TextureArray::build(const std::vector<Material*>& materials){
+    typedef std::tuple<Type, int, int, GLenum> Key;
+    std::map<Key, std::vector<std::pair<Material*, Texture*>>> groups;
+
+    for (Material* m: materials){
+        for (Texture* t: m->getTextures()){
+            if (t->type() == Cube || t->path().empty() || dynamic_cast<TextureArray*>(t))
+                continue;
+
+            int width, height, components;
+            GLenum format = t->compressedFormat();
+            if (format){
+                // No BC7 encoder for the placeholder level
+                if (format == GL_COMPRESSED_RGBA_BPTC_UNORM || format == GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM)
+                    continue;
+                if (!CompressedImage::readFormat(t->path(), &format, &width, &height))
+                    continue;
+            } else {
+                if (!stbi_info(t->path().c_str(), &width, &height, &components))
+                    continue;
+                format = components == 1 ? GL_RED : components == 2 ? GL_RG : components == 4 ? GL_RGBA : GL_RGB;
+            }
+            // Layers are decoded at the reduced size of the quality setting
+            int drop = droppedMips(t->type());
+            groups[Key(t->type(), std::max(1, width >> drop), std::max(1, height >> drop), format)].push_back(std::make_pair(m, t));
+        }
+    }
+
+    std::vector<TextureArray*> arrays;
+    for (auto& g: groups){
+        // A texture shared by several materials takes a single layer
+        std::map<Texture*, int> layers;
+        for (auto& p: g.second){
+            int next = layers.size();
+            layers.insert(std::make_pair(p.second, next));
+        }
+        if (layers.size() < 2)
+            continue;
+
+        TextureArray* a = new TextureArray(std::get<0>(g.first), std::get<1>(g.first), std::get<2>(g.first), std::get<3>(g.first), layers.size());
+        for (auto& l: layers)
+            a->load(l.second, l.first->path());
+        for (auto& p: g.second){
+            p.first->setLayer(p.second, a, layers[p.second]);
+            TextureCache::release(p.second, true);
+        }
+        // Each material now holds the array instead of its texture
+        TextureCache::adopt(a, g.second.size());
+
+        DEBUG(Debug::Info, "Texture array %dx%d with %d layers\n", a->width(), a->height(), a->layers());
+        arrays.push_back(a);
+    }
+    return arrays;
+}
@@ -0,0 +1,56 @@
+#ifndef TEXTURE_ARRAY_H
+#define TEXTURE_ARRAY_H
+
+#include "texture.hpp"
+
+#include <vector>
+
+class Material;
+
+/**!
+ * \short GL_TEXTURE_2D_ARRAY holding same size, same format images as layers
+ * Materials reference a layer instead of a texture of their own, so that
+ * meshes drawn one after the other keep the same texture bound and only
+ * change the layer uniform. Layers are decoded like any other texture;
+ * until all are resident the array samples its smallest level, filled with
+ * the placeholder color.
+ */
+class TextureArray: public Texture {
+    public:
+        /**!
+         * \param format GL_RED, GL_RG, GL_RGB, GL_RGBA or a block compression format
+         */
+        TextureArray(Type t, int width, int height, GLenum format, int layers);
+
+        /**!
+         * \short Queue the decode of a file into one of the layers
+         */
+        void load(int layer, std::string path);
+
+        inline int layers() const { return _layers; }
+        
+        size_t bytes() const;
+
+        /**!
+         * \short Move the textures of these materials sharing size, format and usage into arrays
+         * Textures in no group of at least two are left alone. Moved textures are released from TextureCache,
+         * which adopts the arrays instead.
+         * \return The arrays created
+         */
+        static std::vector<TextureArray*> build(const std::vector<Material*>& materials);
+
+    protected:
+        void _upload(const Decoded& d);
+
+        /**!
+         * \short Fill every level of a layer with the placeholder color, for a layer that failed to decode or does not fit
+         */
+        void _fillPlaceholder(int layer);
+
+    private:
+        int _layers;
+        int _pending;           // layers not uploaded yet
+        int _loaded_levels;     // shortest prebuilt mip chain among the layers
+};
+
+#endif
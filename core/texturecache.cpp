@@ -0,0 +1,133 @@
+#include "texturecache.hpp"
+#include "common.hpp"
+#include "profiler.hpp"
+
+#include <stdlib.h>
+#include <limits.h>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <algorithm>
+
+size_t TextureCache::BUDGET = 0;
+int TextureCache::MIN_SIZE = 64;
+unsigned TextureCache::EVICT_DELAY = 60;
+std::map<std::string, TextureCache::Entry> TextureCache::ENTRIES;
+
+Texture* TextureCache::acquire(std::string filename, std::string directory, Texture::Type type){
+    if (!directory.empty())
+        filename = directory + '/' + filename;
+
+    // The canonical path, so that relative paths and symbolic links to one file share a texture
+    char resolved[PATH_MAX];
+    std::string key = realpath(filename.c_str(), resolved) ? resolved : filename;
+    key += '#' + std::to_string((int)type);
+
+    auto it = ENTRIES.find(key);
+    if (it != ENTRIES.end()){
+        it->second.refs++;
+        return it->second.texture;
+    }
+
+    Texture* t = Texture::fromFile(filename, "", type);
+    if (t)
+        ENTRIES[key] = Entry{t, 1};
+    return t;
+}
+
+void TextureCache::release(Texture* t, bool purge){
+    for (auto it = ENTRIES.begin(); it != ENTRIES.end(); it++){
+        if (it->second.texture != t)
+            continue;
+        if (--it->second.refs <= 0 && purge){
+            delete t;
+            ENTRIES.erase(it);
+        }
+        return;
+    }
+    // Not one of ours, the caller was its only owner
+    if (purge)
+        delete t;
+}
+
+void TextureCache::adopt(Texture* t, int refs){
+    static int adopted = 0;
+    ENTRIES["<adopted " + std::to_string(adopted++) + ">#" + std::to_string((int)t->type())] = Entry{t, refs};
+}
+
+void TextureCache::update(){
+    PROFILE_SCOPE("TextureCache::update");
+
+    unsigned frame = Texture::FRAME++;
+    size_t resident = residentBytes();
+
+    // Degraded textures that were drawn in the last frame get their levels back if they fit
+    for (auto& e: ENTRIES){
+        Texture* t = e.second.texture;
+        if (!t->_dropped || t->_reloading || t->_last_used != frame)
+            continue;
+        size_t full = t->bytes() << (2 * t->_dropped);
+        if (BUDGET && resident - t->bytes() + full > BUDGET)
+            continue;
+        t->_reload();
+        resident += full - t->bytes();
+    }
+
+    if (!BUDGET || resident <= BUDGET)
+        return;
+
+    std::vector<std::map<std::string, Entry>::iterator> unused;
+    for (auto it = ENTRIES.begin(); it != ENTRIES.end(); it++)
+        if (it->second.texture->resident() && frame - it->second.texture->_last_used >= EVICT_DELAY)
+            unused.push_back(it);
+    std::sort(unused.begin(), unused.end(), [](std::map<std::string, Entry>::iterator a, std::map<std::string, Entry>::iterator b){
+        return a->second.texture->_last_used < b->second.texture->_last_used;
+    });
+
+    // Lower mips first, least recently used first
+    for (auto it: unused){
+        Texture* t = it->second.texture;
+        while (resident > BUDGET && std::min(t->width(), t->height()) > MIN_SIZE){
+            size_t before = t->bytes();
+            if (!t->_dropTopMip())
+                break;
+            resident -= before - t->bytes();
+        }
+        if (resident <= BUDGET)
+            return;
+    }
+
+    // Then the textures nobody holds anymore
+    for (auto it: unused){
+        if (it->second.refs > 0)
+            continue;
+        DEBUG(Debug::Info, "Evicting texture %s\n", it->second.texture->path().c_str());
+        resident -= it->second.texture->bytes();
+        delete it->second.texture;
+        ENTRIES.erase(it);
+        if (resident <= BUDGET)
+            return;
+    }
+}
+
+size_t TextureCache::residentBytes(){
+    size_t total = 0;
+    for (auto& e: ENTRIES)
+        total += e.second.texture->bytes();
+    return total;
+}
+
+void TextureCache::report(){
+    std::cout << std::endl << "Texture cache, " << ENTRIES.size() << " textures (KiB, size, levels dropped, references, frames unused):" << std::endl;
+    for (auto& e: ENTRIES){
+        Texture* t = e.second.texture;
+        std::cout << std::setw(40) << (t->path().empty() ? e.first : t->path()) << std::setw(10) << t->bytes() / 1024
+                  << std::setw(6) << t->width() << 'x' << std::left << std::setw(6) << t->height() << std::right
+                  << std::setw(4) << t->_dropped << std::setw(4) << e.second.refs
+                  << std::setw(8) << Texture::FRAME - t->_last_used << std::endl;
+    }
+    std::cout << "Resident: " << residentBytes() / 1024 << " KiB";
+    if (BUDGET)
+        std::cout << " of a " << BUDGET / 1024 << " KiB budget";
+    std::cout << std::endl;
+}
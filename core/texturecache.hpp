@@ -0,0 +1,66 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include "texture.hpp"
+
+#include <string>
+#include <map>
+
+/**!
+ * \short Shared, reference counted textures loaded from files, kept under a video memory budget
+ * Textures are keyed by their canonical path and usage, so that two models
+ * using a "base.png" of their own get two textures. When the resident bytes
+ * go over \ref BUDGET, the textures not drawn lately first lose their top
+ * mip levels, least recently used first; those no one references anymore
+ * are deleted. A degraded texture drawn again is decoded anew when the
+ * budget allows it. Materials hold one reference per texture they sample,
+ * given back when they are destroyed; texture arrays are adopted with one
+ * reference per material sampling one of their layers.
+ */
+class TextureCache {
+    public:
+        /**!
+         * \short Texture for that file, loaded on first use
+         * \return nullptr when the file cannot be opened
+         */
+        static Texture* acquire(std::string filename, std::string directory = "", Texture::Type type = Texture::Diffuse);
+
+        /**!
+         * \short Give back a reference taken with \ref acquire
+         * \param purge Delete the texture right away when that was the last reference,
+         *              instead of keeping it around until memory is needed
+         */
+        static void release(Texture* t, bool purge = false);
+
+        /**!
+         * \short Take over a texture not loaded through \ref acquire, such as a texture array
+         * Adopted textures count against the budget and are deleted once their references are released.
+         */
+        static void adopt(Texture* t, int refs);
+
+        /**!
+         * \short Advance the frame counter and evict or restore textures, from the GL thread once per frame
+         */
+        static void update();
+
+        static size_t residentBytes();
+
+        /**!
+         * \short Print the bytes, size and references of every cached texture
+         */
+        static void report();
+
+        static size_t BUDGET;           // bytes, 0 for no limit
+        static int MIN_SIZE;            // textures are not shrunk below that many texels per side
+        static unsigned EVICT_DELAY;    // frames a texture must stay unused before losing levels
+
+    private:
+        struct Entry {
+            Texture* texture;
+            int refs;
+        };
+
+        static std::map<std::string, Entry> ENTRIES;
+};
+
+#endif
@@ -26,6 +26,9 @@ bool Window::initialise(){
 	
 
     std::cout << "OpenGL " << glGetString(GL_VERSION) << ", GLSL " << glGetString(GL_SHADING_LANGUAGE_VERSION) << std::endl;
+
+    if (Debug::GL_ERROR_MODE != Debug::GLErrorsOff && !Debug::InstallGLDebugCallback())
+        DEBUG(Debug::Warning, "No debug output extension, OpenGL errors are only reported in strict mode\n");
   
     glfwSetInputMode(_gl_window, GLFW_STICKY_KEYS, GL_TRUE);
     
@@ -1,6 +1,7 @@
 // Include standard headers
 #include <stdio.h>
 #include <stdlib.h>
+#include <ctype.h>
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
@@ -17,7 +18,14 @@
 #include "core/models.hpp"
 #include "core/scene.hpp"
 #include "core/animations.hpp"
+#include "core/profiler.hpp"
+#include "core/skinning.hpp"
+#include "core/jobs.hpp"
+#include "core/compressed.hpp"
+#include "core/texturearray.hpp"
+#include "core/texturecache.hpp"
 
+#include "core/particlesVolcano.h"
 #include "assets/utils.hpp"
 #include "assets/world.hpp"
 
@@ -28,6 +36,9 @@ int main(int argc, char** argv){
 
     bool show_fps = false, disable_skybox = false, free_camera = false, display_tree = false;
     char* marker_attach = NULL;
+    bool profile = false, uniform_report = false, bench_skinning = false, bench_animation = false, bench_particles = false, texture_arrays = false, texture_report = false;
+    bool animation_report = false;
+    int bench_models = 300;
     
     int argCount;
     for (argc--, argv++; argc > 0; argc -= argCount, argv += argCount){
@@ -38,6 +49,103 @@ int main(int argc, char** argv){
                 marker_attach = *(argv + 1);
             else
                 DEBUG(Debug::Error, "--attach-marker requires a positionnal argument.\n");
+        } else if (!strcmp (*argv, "--trace")){
+            argCount++;
+            if (argc > 1)
+                Profiler::capture(*(argv + 1), 60, 120);
+            else
+                DEBUG(Debug::Error, "--trace requires a positionnal argument.\n");
+        } else if (!strcmp (*argv, "--profile")){
+            profile = true;
+            Profiler::enable();
+        } else if (!strcmp (*argv, "--gl-errors")){
+            argCount++;
+            if (argc > 1 && !strcmp (*(argv + 1), "off"))
+                Debug::GL_ERROR_MODE = Debug::GLErrorsOff;
+            else if (argc > 1 && !strcmp (*(argv + 1), "async"))
+                Debug::GL_ERROR_MODE = Debug::GLErrorsAsync;
+            else if (argc > 1 && !strcmp (*(argv + 1), "strict"))
+                Debug::GL_ERROR_MODE = Debug::GLErrorsStrict;
+            else
+                DEBUG(Debug::Error, "--gl-errors requires one of off, async or strict.\n");
+        } else if (!strcmp (*argv, "--strict-uniforms")){
+            Shader::STRICT_UNIFORMS = true;
+        } else if (!strcmp (*argv, "--uniform-report")){
+            uniform_report = true;
+        } else if (!strcmp (*argv, "--no-shader-cache")){
+            Shader::BINARY_CACHE = false;
+        } else if (!strcmp (*argv, "--cpu-skinning")){
+            Skin::MODE = Skin::CPU;
+        } else if (!strcmp (*argv, "--bench-skinning")){
+            bench_skinning = true;
+        } else if (!strcmp (*argv, "--bench-particles")){
+            bench_particles = true;
+        } else if (!strcmp (*argv, "--bench-animation")){
+            bench_animation = true;
+            if (argc > 1 && isdigit(**(argv + 1))){
+                argCount++;
+                bench_models = atoi(*(argv + 1));
+            }
+        } else if (!strcmp (*argv, "--threads")){
+            argCount++;
+            if (argc > 1)
+                JobSystem::start(atoi(*(argv + 1)));
+            else
+                DEBUG(Debug::Error, "--threads requires a positionnal argument.\n");
+        } else if (!strcmp (*argv, "--upload-budget")){
+            argCount++;
+            if (argc > 1)
+                Texture::UPLOAD_BUDGET = atof(*(argv + 1));
+            else
+                DEBUG(Debug::Error, "--upload-budget requires a positionnal argument.\n");
+        } else if (!strcmp (*argv, "--convert-textures")){
+            // Offline step, no window needed
+            return CompressedImage::convertDirectory(argc > 1 ? *(argv + 1) : "textures") ? EXIT_SUCCESS : EXIT_FAILURE;
+        } else if (!strcmp (*argv, "--bake-cubemap")){
+            return Texture::bakeCubemap(argc > 1 ? *(argv + 1) : "skyboxes/basic_sky") ? EXIT_SUCCESS : EXIT_FAILURE;
+        } else if (!strcmp (*argv, "--no-compressed-textures")){
+            Texture::PREFER_COMPRESSED = false;
+        } else if (!strcmp (*argv, "--texture-quality")){
+            argCount++;
+            if (argc > 1){
+                if (!Texture::parseQuality(*(argv + 1)))
+                    return EXIT_FAILURE;
+            } else
+                DEBUG(Debug::Error, "--texture-quality requires a positionnal argument.\n");
+        } else if (!strcmp (*argv, "--texture-arrays")){
+            texture_arrays = true;
+        } else if (!strcmp (*argv, "--texture-budget")){
+            argCount++;
+            if (argc > 1)
+                TextureCache::BUDGET = (size_t)(atof(*(argv + 1)) * 1024 * 1024);
+            else
+                DEBUG(Debug::Error, "--texture-budget requires a positionnal argument.\n");
+        } else if (!strcmp (*argv, "--texture-report")){
+            texture_report = true;
+        } else if (!strcmp (*argv, "--bindless")){
+            Texture::BINDLESS = true;
+        } else if (!strcmp (*argv, "--compress-animations")){
+            argCount++;
+            if (argc > 1)
+                Animation::COMPRESSION_TOLERANCE = atof(*(argv + 1));
+            else
+                DEBUG(Debug::Error, "--compress-animations requires a positionnal argument.\n");
+        } else if (!strcmp (*argv, "--bake-animations")){
+            argCount++;
+            if (argc > 1)
+                BakedAnimation::RATE = atof(*(argv + 1));
+            else
+                DEBUG(Debug::Error, "--bake-animations requires a positionnal argument.\n");
+        } else if (!strcmp (*argv, "--no-animation-lod")){
+            AnimationLOD::ENABLED = false;
+        } else if (!strcmp (*argv, "--sim-rate")){
+            argCount++;
+            if (argc > 1 && atof(*(argv + 1)) > 0.)
+                Scene::STEP = 1. / atof(*(argv + 1));
+            else
+                DEBUG(Debug::Error, "--sim-rate requires a positive positionnal argument.\n");
+        } else if (!strcmp (*argv, "--animation-report")){
+            animation_report = true;
         } else if (!strcmp (*argv, "--show-fps")){
             show_fps = true;
         } else if (!strcmp (*argv, "--display-tree")){
@@ -47,11 +155,24 @@ int main(int argc, char** argv){
         } else if (!strcmp (*argv, "--free-camera")){
             free_camera = true;
         } else {
-            fprintf(stderr, "petit_pied [--attach-marker <node_name> | --free-camera | --show-fps | --display-tree | --disable-skybox]\n\n");
+            fprintf(stderr, "petit_pied [--attach-marker <node_name> | --free-camera | --show-fps | --display-tree | --disable-skybox | --profile | --trace <output.json> | --gl-errors <off|async|strict> | --strict-uniforms | --uniform-report | --no-shader-cache | --cpu-skinning | --bench-skinning | --bench-animation [models] | --bench-particles | --threads <workers> | --upload-budget <ms> | --convert-textures [directory] | --bake-cubemap [skybox] | --no-compressed-textures | --texture-arrays | --texture-quality <high|medium|low>[,<type>=<quality>...] | --texture-budget <MiB> | --texture-report | --bindless | --animation-report | --compress-animations <tolerance> | --bake-animations <fps> | --no-animation-lod | --sim-rate <Hz>]\n\n");
             return EXIT_SUCCESS;
         }
     }
     
+    if (bench_skinning){
+        Skin::benchmark();
+        return EXIT_SUCCESS;
+    }
+    if (bench_particles){
+        ParticleSystem::benchmark();
+        return EXIT_SUCCESS;
+    }
+    if (bench_animation){
+        Animation::benchmark(bench_models);
+        return EXIT_SUCCESS;
+    }
+    
 	// Initialise GLFW
 	if( !glfwInit() )
 	{
@@ -68,6 +189,10 @@ int main(int argc, char** argv){
 #endif
 
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	
+	// A debug context makes every message synchronous and complete, only worth it when debugging
+	if (Debug::GL_ERROR_MODE == Debug::GLErrorsStrict)
+	    glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GL_TRUE);
 
 	// Open a window and create its OpenGL context
 	
@@ -84,7 +209,13 @@ int main(int argc, char** argv){
 
             Scene* scene = DinoWorld::buildScene();   
              
+            // Skybox, its program compiles while the textures are decoded
+            if (!disable_skybox)
+                scene->setSkybox("skyboxes/basic_sky", "shaders/vertexshader_skybox.glsl","shaders/fragment_skybox.glsl" );
+            
             TextureLoader* tl = new TextureLoader;
+            if (texture_arrays)
+                TextureArray::build(TextureLoader::materials());
             tl->loadTextures(scene->rootNode());       
             
             //~ Camera mainCamera;
@@ -94,17 +225,13 @@ int main(int argc, char** argv){
             if (marker_attach){
                 if (scene->findNode(marker_attach)){
                     Node* markerNode = new Node("MarkerNode", glm::mat4(1.f), scene, scene->rootNode());
-                    markerNode->addChild("markerMesh", new ReferenceMarker(Shader::fromFiles( "shaders/vertexshader_marker.glsl", "shaders/fragment_marker.glsl")));
+                    markerNode->addChild("markerMesh", new ReferenceMarker(Shader::fromFiles( "shaders/vertexshader_marker.glsl", "shaders/fragment_marker.glsl", true)));
                     markerNode->parent(scene->findNode(marker_attach));
                     scene->findNode(marker_attach)->addChild("marker", markerNode);
                 } else
                     DEBUG(Debug::Error, "Cannot find the node '%s' to attach marker on. Skipping\n", marker_attach);
             }
             
-            // Skybox
-            if (!disable_skybox)
-                scene->setSkybox("skyboxes/basic_sky", "shaders/vertexshader_skybox.glsl","shaders/fragment_skybox.glsl" );
-            
 
             window.hideCursor();
             window.centerCursor();
@@ -114,28 +241,46 @@ int main(int argc, char** argv){
             
             if (display_tree)
                 scene->displayNodeTree();  
+            if (animation_report)
+                Animation::memoryReport();
             
             float time_last_frame = glfwGetTime();
+            double clock = glfwGetTime();
             DEBUG(Debug::Info, "\n");
             
             
             do{ 
+                Profiler::beginFrame();
+                double now = glfwGetTime();
+                double elapsed = now - clock;
+                clock = now;
+                
+                Texture::processUploads(Texture::UPLOAD_BUDGET);
+                TextureCache::update();
+                
                 // Clear the screen
                 glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
                 
                 // Update P and V from mouse and keyboard
-                mainCamera.updateFromMouse();
+                {
+                    PROFILE_SCOPE("Camera::updateFromMouse");
+                    mainCamera.updateFromMouse(elapsed);
+                }
                 
                 int newState = glfwGetKey( window.internal(), GLFW_KEY_K );
                 if (newState == GLFW_RELEASE && oldState == GLFW_PRESS) {
                        scene->light()->type((Light::Type)(((int)scene->light()->type() + 1) % (int)Light::PhongWithNormal));
                     oldState = newState;
                 }
+                scene->advance(elapsed);
                 scene->render();
 
                 // Swap buffers
-                window.swap();
-                glfwPollEvents();
+                {
+                    PROFILE_SCOPE("Window::swap");
+                    window.swap();
+                    glfwPollEvents();
+                }
 
                 // Swap buffers
                 window.postDrawingEvent();
@@ -144,6 +289,7 @@ int main(int argc, char** argv){
                     DEBUG(Debug::Error, "\rFPS: %f", 1.f / (glfwGetTime() - time_last_frame));
                     
                 time_last_frame = glfwGetTime();
+                Profiler::endFrame();
             }
 
             // Check if the ESC key was pressed or the window was closed
@@ -152,6 +298,13 @@ int main(int argc, char** argv){
 
             DEBUG(Debug::Info, "\n");
             
+            if (profile)
+                Profiler::report();
+            if (uniform_report)
+                Shader::reportMissingUniforms();
+            if (texture_report)
+                TextureCache::report();
+            
     } catch (OpenGLException* e){
             std::cout << "OpenGL exception: " << e->what() << std::endl;
             glfwTerminate();
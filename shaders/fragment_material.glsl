@@ -1,14 +1,50 @@
 #version 330 core
 
+// Plain 2D samplers are given bindless handles instead of units when the variant has BINDLESS
+#ifdef BINDLESS
+#extension GL_ARB_bindless_texture : require
+#define SAMPLER_2D layout(bindless_sampler) uniform sampler2D
+#else
+#define SAMPLER_2D uniform sampler2D
+#endif
+
 out vec4 FragColor;
 in vec2 TexCoords;
 
-uniform sampler2D texture_diffuse;
-uniform sampler2D texture_specular;
-uniform sampler2D texture_height;
-uniform sampler2D texture_normal;
-
-uniform bool has_diffuse = false, has_specular = false, has_normal = false, has_height = false; 
+// HAS_DIFFUSE, HAS_SPECULAR, HAS_NORMAL and HAS_HEIGHT are defined by the program variant,
+// DIFFUSE_ARRAY, ... when the texture is a layer of a texture array
+#ifdef DIFFUSE_ARRAY
+uniform sampler2DArray texture_diffuse_array;
+uniform float layer_diffuse;
+#define SAMPLE_DIFFUSE(uv) texture(texture_diffuse_array, vec3(uv, layer_diffuse))
+#else
+SAMPLER_2D texture_diffuse;
+#define SAMPLE_DIFFUSE(uv) texture(texture_diffuse, uv)
+#endif
+#ifdef SPECULAR_ARRAY
+uniform sampler2DArray texture_specular_array;
+uniform float layer_specular;
+#define SAMPLE_SPECULAR(uv) texture(texture_specular_array, vec3(uv, layer_specular))
+#else
+SAMPLER_2D texture_specular;
+#define SAMPLE_SPECULAR(uv) texture(texture_specular, uv)
+#endif
+#ifdef HEIGHT_ARRAY
+uniform sampler2DArray texture_height_array;
+uniform float layer_height;
+#define SAMPLE_HEIGHT(uv) texture(texture_height_array, vec3(uv, layer_height))
+#else
+SAMPLER_2D texture_height;
+#define SAMPLE_HEIGHT(uv) texture(texture_height, uv)
+#endif
+#ifdef NORMAL_ARRAY
+uniform sampler2DArray texture_normal_array;
+uniform float layer_normal;
+#define SAMPLE_NORMAL(uv) texture(texture_normal_array, vec3(uv, layer_normal))
+#else
+SAMPLER_2D texture_normal;
+#define SAMPLE_NORMAL(uv) texture(texture_normal, uv)
+#endif
 
 struct Material {
     vec3 ambient;
@@ -39,8 +75,9 @@ uniform Light light;
 vec4 basicTextured() {
     vec3 ambient = light.ambient * material.ambient;
     vec3 diffuse = light.diffuse * (0.5 * material.diffuse);
-    if(has_diffuse)
-        diffuse *= texture(texture_diffuse, TexCoords).xyz;
+#ifdef HAS_DIFFUSE
+    diffuse *= SAMPLE_DIFFUSE(TexCoords).xyz;
+#endif
     
     return vec4(ambient + diffuse, 1.0);
 }
@@ -74,10 +111,11 @@ vec4 phongShading(vec4 texColor) {
     
     
     //return vec4(ambient + diffuse, 1) * texColor + vec4(specular, 1);
-    if(has_diffuse)
-        return vec4(texColor.xyz + ambient + diffuse + specular, 1.0);
-    else
-        return vec4(ambient + diffuse + specular, 1.0);
+#ifdef HAS_DIFFUSE
+    return vec4(texColor.xyz + ambient + diffuse + specular, 1.0);
+#else
+    return vec4(ambient + diffuse + specular, 1.0);
+#endif
 }
 
 vec4 phongShadingBumpMapping(vec4 texColor, vec3 lightDir, vec3 eyeDir, vec3 normal, vec3 normalvec) {
@@ -102,7 +140,7 @@ vec4 phongShadingBumpMapping(vec4 texColor, vec3 lightDir, vec3 eyeDir, vec3 nor
     
     //Specular component
     //vec3 specular = (facing ? light.specular * material.specular * pow(max(dot(R, eyeDir), 0.0), material.shininess) : vec3(0.0));
-    vec4 specmap = texture(texture_specular, TexCoords);
+    vec4 specmap = SAMPLE_SPECULAR(TexCoords);
     vec3 specular = clamp(light.specular * material.specular * pow(max(dot(R, eyeDir), 0.0), material.shininess) * specmap.xyz, 0, 1);
     
     //return vec4(ambient + diffuse, 1) * texColor + vec4(specular, 1);
@@ -116,10 +154,11 @@ void main()
         
     // Local normal, in tangent space. Expanding the range of the normal space
     vec3 tangentNormal;
-    if(has_height)
-        tangentNormal= normalize(texture2D(texture_height, TexCoords).rgb*2.0 - 1.0);
-    else
-        tangentNormal= normalize(Normal * 2.0 - 1.0);
+#ifdef HAS_HEIGHT
+    tangentNormal= normalize(SAMPLE_HEIGHT(TexCoords).rgb*2.0 - 1.0);
+#else
+    tangentNormal= normalize(Normal * 2.0 - 1.0);
+#endif
         
     // Calculate the lighting diffuse value  */
     float diff = max(dot(tangentNormal, light.position), 0.0);
@@ -135,11 +174,12 @@ void main()
     vec3 E = normalize(-PosEyeSpace); // we are in Eye Coordinates, so EyePos is (0,0,0)
     
     //Bump mapping
-    vec3 normal_tangentspace = normalize((texture( texture_height, TexCoords ).rgb-0.5) * 2.0);
-    if(has_height){
-        if(has_diffuse)
-            FragColor = phongShading(texture(texture_diffuse, TexCoords));
-        else {
+    vec3 normal_tangentspace = normalize((SAMPLE_HEIGHT(TexCoords).rgb-0.5) * 2.0);
+#ifdef HAS_HEIGHT
+#ifdef HAS_DIFFUSE
+    FragColor = phongShading(SAMPLE_DIFFUSE(TexCoords));
+#else
+        {
             // ambient
             vec3 ambient = light.ambient * material.ambient;
             
@@ -156,8 +196,10 @@ void main()
             vec3 specular = light.specular * (spec * material.specular);  
             FragColor = phongShading(vec4(ambient + diffuse + specular, 1.0));
         }
-    }
-    else FragColor = phongShadingBumpMapping(texture(texture_diffuse, TexCoords), lightDirection_tangentspace, eyeDirection_tangentspace, normal_tangentspace, Normal);
+#endif
+#else
+    FragColor = phongShadingBumpMapping(SAMPLE_DIFFUSE(TexCoords), lightDirection_tangentspace, eyeDirection_tangentspace, normal_tangentspace, Normal);
+#endif
     //////////////////////////////
     
     // ambient
@@ -175,10 +217,11 @@ void main()
         
     vec3 result = ambient + diffuse + specular;
 
-        if(has_diffuse)
-            FragColor = texture(texture_diffuse, TexCoords);
-        else
-            FragColor = vec4(ambient + diffuse + specular, 1.0);
+#ifdef HAS_DIFFUSE
+    FragColor = SAMPLE_DIFFUSE(TexCoords);
+#else
+    FragColor = vec4(ambient + diffuse + specular, 1.0);
+#endif
 
             
     
@@ -7,15 +7,13 @@ layout (location = 4) in vec4 Weights;
 layout (location = 5) in vec3 aTangent;
 layout (location = 6) in vec3 aBitangent;
 
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+uniform mat4 mvp;
 
 uniform vec3 color;
 
 void main()
 {
-	gl_Position = projection * view * model * vec4(aPos, 1.0);
+	gl_Position = mvp * vec4(aPos, 1.0);
 }
 
 
@@ -21,17 +21,13 @@ out vec3 eyeDirection_tangentspace;
 
 const int MAX_BONES = 100;
 
+// Computed once per draw on the CPU
 uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+uniform mat4 modelView;
+uniform mat4 mvp;
+uniform mat3 normalMatrix;
+// Skinning matrices in mesh space, only with HAS_BONES
 uniform mat4 gBones[MAX_BONES];
-mat4 MIT = mat4(1.0); //Inverse transpose of the model
-
-mat4 mv = mat4(1.0);
-vec3 aNormal_cameraspace;
-vec3 aTangent_cameraspace;
-vec3 aBitangent_cameraspace;
-mat3 TBN;
 
 uniform int type;
 
@@ -45,68 +41,31 @@ struct Light {
 
 uniform Light light;
 
-void preBillPhong() {
-    mv = view* model;
-    MIT = transpose(inverse(model));
-    //Calculating the vertex position into eyespace
-    PosEyeSpace = (view * model * vec4(aPos, 1.0)).xyz;
-    
-    //Normal to be passed to the fragment shder 
-    Normal = mat3(inverse(model)) * aNormal;  
-}
-
-void fromCameraToTangent() {
-    
-    MIT = transpose(inverse(model));
-    mv = view* MIT;
-    //we need to use the inverse transpose to take into account transformations
-    
-    aNormal_cameraspace = mat3(mv) * normalize(aNormal);
-    aTangent_cameraspace = mat3(mv) * normalize(aTangent);
-    aBitangent_cameraspace = mat3(mv) * normalize(aBitangent);
-    
-    //This matrix takes us from camera sace to tanent space
-    TBN = inverse(mat3(aTangent, aBitangent, aNormal));
-    
-    vec4 v        = model * vec4(aPos, 1.0);                  // vertex in model space
-    lightDirection_tangentspace  = TBN * (inverse(model) * vec4(light.position - v.xyz, 0)).xyz;  // light vector in tangent space
-    
-    v = view * model * vec4(aPos, 1.0);                       // vertex in eye space
-    vec4 light_vector_eye  = normalize((view * vec4(light.position, 1.0)) - v); // light vector in eye space
-    vec4 viewer_vector_eye = normalize(-v);                     // view vector in eye space
- 
-    eyeDirection_tangentspace = TBN * (inverse(view * model) * vec4((light_vector_eye.xyz + viewer_vector_eye.xyz), 0.0)).xyz;
-                                            // halfway vector in tangent space
-                                            
-    Normal = inverse(transpose(TBN)) * aNormal;
-
-}
-
 void main() 
 {
-    
-    mv = view* model;
-    MIT = transpose(inverse(model));
-
-    mat4 BoneTransform = mat4(1.);
+#ifdef HAS_BONES
+    // Weights missing to reach one keep the bind pose
+    float rest = 1. - Weights[0] - Weights[1] - Weights[2] - Weights[3];
+    mat4 BoneTransform = mat4(1.) * rest;
     BoneTransform += gBones[BoneIDs[0]] * Weights[0];
     BoneTransform += gBones[BoneIDs[1]] * Weights[1];
     BoneTransform += gBones[BoneIDs[2]] * Weights[2];
     BoneTransform += gBones[BoneIDs[3]] * Weights[3];
     
-    FragPos = vec3(model * vec4(aPos, 1.0));
-    
-    // Unfortunately, we never made it    
-    //~ Normal = (BoneTransform * vec4(aNormal, 0.0)).xyz;  
-    //~ vec4 PosL      = BoneTransform * vec4(aPos, 1.0);
+    vec4 PosL      = BoneTransform * vec4(aPos, 1.0);
+    vec3 NormalL   = mat3(BoneTransform) * aNormal;
+#else
+    vec4 PosL      = vec4(aPos, 1.0);
+    vec3 NormalL   = aNormal;
+#endif
     
-    Normal = mat3(transpose(inverse(model))) * aNormal;
+    FragPos = vec3(model * PosL);
     
-    vec4 PosL      = vec4(aPos, 1.0);
-    mat4 mvp = projection * view * model;
+    //Calculating the vertex position into eyespace
+    PosEyeSpace = (modelView * PosL).xyz;
     
-    preBillPhong();
-    //fromCameraToTangent();
+    //Normal to be passed to the fragment shder 
+    Normal = normalMatrix * NormalL;
     
     gl_Position = mvp * PosL;
     TexCoords = aTexCoords;    
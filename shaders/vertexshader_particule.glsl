@@ -4,6 +4,7 @@
 layout(location = 0) in vec3 squareVertices;
 layout(location = 1) in vec4 xyzs; // Position of the center of the particule and size of the square
 layout(location = 2) in vec4 color; // Position of the center of the particule and size of the square
+layout(location = 3) in vec4 previous_xyzs; // xyzs before the last simulation step
 
 // Output data ; will be interpolated for each fragment.
 
@@ -12,12 +13,14 @@ out vec4 particlecolor;
 // Values that stay constant for the whole mesh.
 uniform vec3 CameraRight_worldspace;
 uniform vec3 CameraUp_worldspace;
-uniform mat4 P, V, M; // Model-View-Projection matrix, but without the Model (the position is in BillboardPos; the orientation depends on the camera)
+uniform mat4 MVP; // Model-View-Projection matrix, computed once per draw on the CPU
+uniform float blend; // how far from the previous step to the last one this frame is
 
 void main()
 {
-	float particleSize = xyzs.w; // because we encoded it this way.
-	vec3 particleCenter_wordspace = xyzs.xyz;
+	vec4 interpolated = mix(previous_xyzs, xyzs, blend);
+	float particleSize = interpolated.w; // because we encoded it this way.
+	vec3 particleCenter_wordspace = interpolated.xyz;
 	
 	vec3 vertexPosition_worldspace = 
 		particleCenter_wordspace
@@ -25,7 +28,7 @@ void main()
 		+ CameraUp_worldspace * squareVertices.y * particleSize;
 
 	// Output position of the vertex
-	gl_Position = P * V * M * vec4(vertexPosition_worldspace, 1.0f);
+	gl_Position = MVP * vec4(vertexPosition_worldspace, 1.0f);
 
 	// UV of the vertex. No special space for this one.
 	//~ UV = squareVertices.xy + vec2(0.5, 0.5);